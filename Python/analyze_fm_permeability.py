@@ -5,6 +5,8 @@ import matplotlib.pyplot as plt
 from uncertainties import unumpy
 from uncertainties import ufloat
 import sys
+import os
+import ctypes
 
 #text files of the measured inner and outer radii
 ri_meas = 'ri.txt'
@@ -51,6 +53,57 @@ print("thickness ratio: " + str(c.n))
 u_cloak = (1/c.n**2+1)/(1/c.n**2-1)
 print("Perfect cloak permeability: " + str(u_cloak))
 
+#the permeability inversion is done by the C++ kernel in ROOT/Permeability.h
+#when its shared library has been built (see ROOT/Permeability.C). Otherwise
+#fall back to the uncertainties package, which gives the same numbers but
+#is much slower on long scans.
+lib_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+        'ROOT', 'libPermeability.so')
+try:
+    kernel = ctypes.CDLL(lib_path).fm_invert_permeability
+    col = np.ctypeslib.ndpointer(dtype=np.float64, flags='C_CONTIGUOUS')
+    kernel.argtypes = [ctypes.c_int, col, col, col, col, ctypes.c_double,
+            ctypes.c_double, col, col, col, col]
+    kernel.restype = None
+except OSError:
+    kernel = None
+
+#define a function that takes the external and internal fields with their
+#uncertainties and the radius ratio, and gives back the permeability with its
+#total, point to point and geometry only uncertainties
+def invert(Bext_nom, Bext_err, Bin_nom, Bin_err, c):
+    if kernel is not None:
+        n = len(Bext_nom)
+        cols = [np.ascontiguousarray(x, dtype=np.float64) for x in
+                (Bext_nom, Bext_err, Bin_nom, Bin_err)]
+        out = [np.empty(n) for k in range(4)]
+        kernel(n, cols[0], cols[1], cols[2], cols[3], c.n, c.s, *out)
+        return out
+
+    Bin = unumpy.uarray(Bin_nom, Bin_err)
+    Bext = unumpy.uarray(Bext_nom, Bext_err)
+    B = Bin/Bext #ratio of internal to external field
+
+    #calculate permeability
+    u = (B*c**2 + B -2 -2*unumpy.sqrt(B**2*c**2 - B*c**2 - B + 1))/(B*c**2-B) 
+    u_nom = unumpy.nominal_values(u)
+    u_err = unumpy.std_devs(u)
+
+    #calculate uerr with just point to point uncertainties. I define this as just
+    #uncertainty from the field measurements
+    u_pp = (B*c.n**2 + B -2 -2*unumpy.sqrt(B**2*c.n**2 - B*c.n**2 - B +
+        1))/(B*c.n**2-B)
+
+    u_err_pp = unumpy.std_devs(u_pp)
+
+    #calculate uerr from just geometry uncertainties
+    u_geom = (unumpy.nominal_values(B)*c**2 + unumpy.nominal_values(B) -2 -2*unumpy.sqrt(unumpy.nominal_values(B)**2*c**2 - unumpy.nominal_values(B)*c**2 - unumpy.nominal_values(B) +
+        1))/(unumpy.nominal_values(B)*c**2-unumpy.nominal_values(B))
+
+    u_err_geom = unumpy.std_devs(u_geom)
+
+    return u_nom, u_err, u_err_pp, u_err_geom
+
 #define a function that will take the ferromagnet scan file and give you the
 #permeability results.
 def plot_u(cal_file, fm_file,  description, accidental_offset,
@@ -75,26 +128,10 @@ def plot_u(cal_file, fm_file,  description, accidental_offset,
     Bext_nom = unumpy.nominal_values(Bext)
     Bext_err = unumpy.std_devs(Bext)
 
-    B = Bin/Bext #ratio of internal to external field
-
     #calculate permeability
-    u = (B*c**2 + B -2 -2*unumpy.sqrt(B**2*c**2 - B*c**2 - B + 1))/(B*c**2-B) 
-    print(u)
-    u_nom = unumpy.nominal_values(u)
-    u_err = unumpy.std_devs(u)
-
-    #cakculate uerr with just point to point uncertainties. I define this as just
-    #uncertainty from the field measurements
-    u_pp = (B*c.n**2 + B -2 -2*unumpy.sqrt(B**2*c.n**2 - B*c.n**2 - B +
-        1))/(B*c.n**2-B)
-
-    u_err_pp = unumpy.std_devs(u_pp)
-
-    #calculate uerr from just geometry uncertainties
-    u_geom = (unumpy.nominal_values(B)*c**2 + unumpy.nominal_values(B) -2 -2*unumpy.sqrt(unumpy.nominal_values(B)**2*c**2 - unumpy.nominal_values(B)*c**2 - unumpy.nominal_values(B) +
-        1))/(unumpy.nominal_values(B)*c**2-unumpy.nominal_values(B))
-
-    u_err_geom = unumpy.std_devs(u_geom)
+    u_nom, u_err, u_err_pp, u_err_geom = invert(Bext_nom, Bext_err, Bin_nom,
+            Bin_err, c)
+    print(u_nom)
 
 
     #write results onto a text file
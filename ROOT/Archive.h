@@ -0,0 +1,1280 @@
+/*
+ * Measurement Campaign Archive
+ *
+ * To pack every data file of every
+ * campaign into one compressed, chunked
+ * column store with a metadata index
+ * (sample, material, Fm, temperature, scan
+ * type, date and geometry), and to load
+ * only the series and chunks a query
+ * selects, ready for plot_uvB and plot_Bvz.
+ * To use in a macro: #include "Archive.h"
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DataFile.h"
+#include "Pipeline.h"
+
+/*
+ * An archive is two files:
+ *
+ *   <archive>.dat  the encoded chunks, back to back,
+ *                  then a "#FMARCv3\t<generation>\n"
+ *                  trailer
+ *   <archive>.idx  a "#FMARCv3 nseries dat_bytes
+ *                  generation" header, then one tab
+ *                  separated line per series and
+ *                  per chunk
+ *
+ *   S id type sample material Fm fv T date r_in r_out R R_sig nrows calib columns path
+ *   K id col chunk nrows offset bytes exp min max
+ *
+ * The generation is unique to each write. The two
+ * files are replaced one after the other, so a
+ * reader only accepts a data file of the size and
+ * generation its index names, and reads the index
+ * again if the data file is already the next one.
+ *
+ * A series is one data file. Its columns are cut
+ * into chunks of kChunkRows rows, stored column by
+ * column. Unknown numbers are written as nan and
+ * unknown strings as "-". The index is small
+ * enough to be read whole; the chunks are only
+ * mapped when a series is loaded.
+ */
+static const long kChunkRows = 65536;
+
+/*
+ * One column of one chunk. The DAQ prints a fixed
+ * number of decimals, so a column is usually a
+ * list of integers m/10^exp: those are stored as
+ * zigzag varints of the row to row differences,
+ * 1-3 bytes a value for slow scans. If no exp <= 9
+ * reproduces every value exactly, the doubles are
+ * stored as they are (exp = -1). Every value reads
+ * back equal to the one written (a "-0.000" from
+ * the DAQ reads back as 0).
+ */
+class ColumnCodec
+{
+ public:
+  static int Encode(long n, const double* v, std::string& out)
+  {
+    static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    for (int exp = 0; exp <= 9; exp++)
+      {
+	const double scale = kPow10[exp];
+	size_t start = out.size();
+	int64_t prev = 0;
+	bool exact = true;
+	for (long i = 0; i < n && exact; i++)
+	  {
+	    const double x = v[i] * scale;
+	    if (!(std::fabs(x) < 4.5e15)) { exact = false; break; }
+	    const int64_t m = (int64_t)std::floor(x + 0.5);
+	    if ((double)m / scale != v[i]) { exact = false; break; }
+	    PutVarint(out, Zigzag(m - prev));
+	    prev = m;
+	  }
+	if (exact) return exp;
+	out.resize(start);
+      }
+    out.append((const char*)v, n * sizeof(double));
+    return -1;
+  }
+
+  /*False if the bytes do not hold n values*/
+  static bool Decode(const char* p, size_t bytes, long n, int exp, double* v)
+  {
+    static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    if (exp < 0)
+      {
+	if (bytes != n * sizeof(double)) return false;
+	memcpy(v, p, bytes);
+	return true;
+      }
+    if (exp > 9) return false;
+    const double scale = kPow10[exp];
+    const char* end = p + bytes;
+    int64_t m = 0;
+    for (long i = 0; i < n; i++)
+      {
+	uint64_t z = 0;
+	for (int shift = 0; ; shift += 7)
+	  {
+	    if (p == end || shift > 63) return false;
+	    const unsigned char c = (unsigned char)*p++;
+	    z |= (uint64_t)(c & 0x7f) << shift;
+	    if (!(c & 0x80)) break;
+	  }
+	m += (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+	v[i] = (double)m / scale;
+      }
+    return p == end;
+  }
+
+ private:
+  static uint64_t Zigzag(int64_t d) { return ((uint64_t)d << 1) ^ (uint64_t)(d >> 63); }
+  static void PutVarint(std::string& out, uint64_t z)
+  {
+    while (z >= 0x80)
+      {
+	out.push_back((char)(z | 0x80));
+	z >>= 7;
+      }
+    out.push_back((char)z);
+  }
+};
+
+struct ArchiveChunk
+{
+  int      col;
+  long     chunk;
+  long     nrows;
+  uint64_t offset;
+  uint64_t bytes;
+  int      exp;
+  double   min, max;
+};
+
+/*
+ * Metadata of one series. type is one of
+ * calibration, fmscan, offset, bvz, map, results,
+ * geometry or other; date is YYYY-MM-DD; Fm is the
+ * steel mass fraction and fv the volume fraction,
+ * nan where unknown; r_in and r_out are the mean
+ * ri/ro (or di/do) of the sample in the units of
+ * those files, R = r_in/r_out.
+ */
+struct ArchiveEntry
+{
+  int         id;
+  std::string type;
+  std::string sample;
+  std::string material;
+  double      Fm;
+  double      fv;
+  double      T;
+  std::string date;
+  double      r_in, r_out, R, R_sig;
+  long        nrows;
+  std::string calib;
+  std::string path;
+  std::vector<std::string> columns;
+  std::vector<ArchiveChunk> chunks;
+
+  int GetColumnIndex(const std::string& name) const
+  {
+    for (size_t i = 0; i < columns.size(); i++)
+      if (columns[i] == name) return (int)i;
+    return -1;
+  }
+  std::string GetDirectory() const
+  {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string() : path.substr(0, slash);
+  }
+};
+
+/*
+ * A query. String fields match as substrings
+ * (type exactly) and empty means any; Fm, fv, T
+ * and date ranges are inclusive. A series with an
+ * unknown Fm (fv) only passes if the Fm (fv) range
+ * is left open. AddRange() also asks for rows with
+ * lo <= column <= hi: a series is selected only if
+ * some chunk can hold such rows, only those chunks
+ * are mapped and the other rows are dropped.
+ */
+struct ArchiveQuery
+{
+  std::string type;
+  std::string sample;
+  std::string material;
+  std::string path;
+  double      Fm_min, Fm_max;
+  double      fv_min, fv_max;
+  double      T_min, T_max;
+  std::string date_min, date_max;
+
+  struct Range
+  {
+    std::string column;
+    double lo, hi;
+  };
+  std::vector<Range> ranges;
+
+  ArchiveQuery()
+    : Fm_min(-HUGE_VAL), Fm_max(HUGE_VAL), fv_min(-HUGE_VAL), fv_max(HUGE_VAL), T_min(-HUGE_VAL), T_max(HUGE_VAL) {}
+
+  void AddRange(const std::string& column, double lo, double hi)
+  {
+    Range r = { column, lo, hi };
+    ranges.push_back(r);
+  }
+
+  bool Match(const ArchiveEntry& e) const
+  {
+    if (!type.empty() && e.type != type) return false;
+    if (!sample.empty() && e.sample.find(sample) == std::string::npos) return false;
+    if (!material.empty() && e.material.find(material) == std::string::npos) return false;
+    if (!path.empty() && e.path.find(path) == std::string::npos) return false;
+    if ((Fm_min > -HUGE_VAL || Fm_max < HUGE_VAL) && !(e.Fm >= Fm_min && e.Fm <= Fm_max)) return false;
+    if ((fv_min > -HUGE_VAL || fv_max < HUGE_VAL) && !(e.fv >= fv_min && e.fv <= fv_max)) return false;
+    if ((T_min > -HUGE_VAL || T_max < HUGE_VAL) && !(e.T >= T_min && e.T <= T_max)) return false;
+    if (!date_min.empty() && (e.date.empty() || e.date < date_min)) return false;
+    if (!date_max.empty() && (e.date.empty() || e.date > date_max)) return false;
+    if (ranges.empty()) return true;
+    const long nchunks = (e.nrows + kChunkRows - 1) / kChunkRows;
+    for (long k = 0; k < nchunks; k++)
+      if (MatchChunk(e, k)) return true;
+    return false;
+  }
+
+  /*Whether chunk k of every ranged column can hold a selected row*/
+  bool MatchChunk(const ArchiveEntry& e, long k) const
+  {
+    for (size_t r = 0; r < ranges.size(); r++)
+      {
+	const int col = e.GetColumnIndex(ranges[r].column);
+	if (col < 0) return false;
+	const ArchiveChunk& c = e.chunks[col * ((e.nrows + kChunkRows - 1) / kChunkRows) + k];
+	if (c.max < ranges[r].lo || c.min > ranges[r].hi) return false;
+      }
+    return true;
+  }
+
+  bool MatchRow(const ArchiveEntry& e, const std::vector<const double*>& cols, long i) const
+  {
+    for (size_t r = 0; r < ranges.size(); r++)
+      {
+	const double x = cols[e.GetColumnIndex(ranges[r].column)][i];
+	if (!(x >= ranges[r].lo && x <= ranges[r].hi)) return false;
+      }
+    return true;
+  }
+};
+
+/*
+ * The decoded columns of one series, with the
+ * same accessors as DataFile so it can stand in
+ * for one.
+ */
+class ArchiveColumns
+{
+ public:
+  ArchiveColumns() : fId(-1), fN(0), fOpen(false) {}
+
+  bool IsOpen() const { return fOpen; }
+  int GetId() const { return fId; }
+  int GetN() const { return (int)fN; }
+  int GetNColumns() const { return (int)fNames.size(); }
+  const char* GetColumnName(int i) const { return fNames[i].c_str(); }
+  int GetColumnIndex(const char* name) const
+  {
+    for (size_t i = 0; i < fNames.size(); i++)
+      if (fNames[i] == name) return (int)i;
+    return -1;
+  }
+  /*Returns 0 for an unknown column*/
+  const double* GetColumn(int i) const
+  {
+    if (i < 0 || i >= (int)fNames.size() || fN == 0) return 0;
+    return &fData[i * fN];
+  }
+  const double* GetColumn(const char* name) const
+  {
+    int i = GetColumnIndex(name);
+    if (i < 0)
+      {
+	std::cerr << "ArchiveColumns: no column named " << name << std::endl;
+	return 0;
+      }
+    return GetColumn(i);
+  }
+
+ private:
+  friend class Archive;
+  int  fId;
+  long fN;
+  bool fOpen;
+  std::vector<std::string> fNames;
+  std::vector<double> fData;
+};
+
+/*
+ * The ArchiveWriter class builds an archive from
+ * directories of measurements. Every text or csv
+ * file with numeric rows becomes a series; the
+ * number of columns is taken from its rows and
+ * the names from a header line ("t/F:I/F:B/F" or
+ * "#Bext, sig_Bext, ...") or, failing that, from
+ * the layout of its type (t I B, z B B_err I I_err,
+ * d, the results columns).
+ * Spreadsheets (.ods) cannot be read and are only
+ * counted.
+ *
+ * The metadata is guessed from the path the way
+ * the campaigns are named:
+ *   type      calib, bvz/b_vs_z, BvsX/XScan, offset/
+ *             initial_mag, results/uvb/uncertainties,
+ *             ri/ro/di/do/diameter in the file name;
+ *             other t, I, B files are fmscan
+ *   date      DataFile_YYMMDD_*, Data_YYYY_MM_DD_* or
+ *             a M-D-YY_ directory
+ *   Fm        NN_MM_ (NN % steel by mass) in a
+ *             directory or file name, the file
+ *             name first
+ *   fv        fv0.NN or fNN, the steel volume
+ *             fraction (e.g. 7-01-15_fv0.4_cryo_v_room,
+ *             uvb_f40_cryo.txt), found the same way
+ *   T         cryo/ln2/"liquid nitrogen" is 77 K,
+ *             room/warm 295 K, the file name first
+ *   material  epoxy, powder, sheet, steel302, wax, purefm
+ *   geometry  ri.txt/ro.txt next to the file
+ *   sample    the directory holding the file
+ *
+ * and can be corrected. AddManifest() takes a
+ * samples_uvB.txt manifest and gives its scan
+ * files their name, Fm, T, calibration and di/do
+ * geometry. AddOverrides() reads lines of
+ *
+ *   <path substring>  key=value  key=value ...
+ *
+ * with keys type, sample, material, Fm, fv, T, date,
+ * calib, r_in, r_out, R, R_sig; later lines win.
+ */
+class ArchiveWriter
+{
+ public:
+  ArchiveWriter(const char* f_archive)
+    : fName(f_archive), fOffset(0), fNSkipped(0), fTextBytes(0), fRows(0)
+  {
+    fDat = fopen((fName + ".dat.tmp").c_str(), "wb");
+    if (!fDat) std::cerr << "ArchiveWriter: cannot write " << fName << ".dat" << std::endl;
+  }
+  ~ArchiveWriter() { Close(); }
+
+  bool IsOpen() const { return fDat != 0; }
+
+  void AddManifest(const char* f_manifest);
+  void AddOverrides(const char* f_overrides);
+  /*Ingest every file under dir; returns the number of series added*/
+  int AddDirectory(const std::string& dir);
+  /*False if the file holds no numeric rows*/
+  bool AddFile(const std::string& f_data);
+  /*Write the index; the archive is replaced only now*/
+  bool Close();
+
+  int GetNSeries() const { return (int)fEntries.size(); }
+  int GetNSkipped() const { return fNSkipped; }
+  long GetNRows() const { return fRows; }
+  uint64_t GetTextBytes() const { return fTextBytes; }
+  uint64_t GetArchiveBytes() const { return fOffset; }
+
+  static std::string CanonicalPath(const std::string& path)
+  {
+    char buf[PATH_MAX];
+    return realpath(path.c_str(), buf) ? std::string(buf) : path;
+  }
+
+ private:
+  ArchiveWriter(const ArchiveWriter&);
+  ArchiveWriter& operator=(const ArchiveWriter&);
+
+  struct Override
+  {
+    std::string pattern;
+    bool exact;
+    std::vector<std::pair<std::string, std::string> > values;
+  };
+
+  static bool Contains(const std::string& s, const char* word) { return s.find(word) != std::string::npos; }
+  static std::string Lower(std::string s)
+  {
+    for (size_t i = 0; i < s.size(); i++) s[i] = (char)tolower((unsigned char)s[i]);
+    return s;
+  }
+  static std::string BaseName(const std::string& path)
+  {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+  }
+  static std::string DirName(const std::string& path)
+  {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+  }
+
+  static int ReadLayout(const char* text, size_t size, std::vector<std::string>& names);
+  static void DefaultLayout(const std::string& type, int ncol, std::vector<std::string>& names);
+  void Describe(ArchiveEntry& e) const;
+  static std::string Classify(const std::string& base, int ncol);
+  static std::string FindDate(const std::string& path);
+  static double FindTemperature(const std::string& path);
+  static double FindFm(const std::string& name);
+  static double FindFv(const std::string& name);
+  static double FindNearest(const std::string& path, double (*find)(const std::string&));
+  static void SetGeometry(ArchiveEntry& e, const std::string& f_inner, const std::string& f_outer);
+  static void Apply(ArchiveEntry& e, const std::string& key, const std::string& value);
+
+  std::string fName;
+  FILE* fDat;
+  uint64_t fOffset;
+  int fNSkipped;
+  uint64_t fTextBytes;
+  long fRows;
+  std::vector<ArchiveEntry> fEntries;
+  std::vector<Override> fOverrides;
+};
+
+inline void ArchiveWriter::AddManifest(const char* f_manifest)
+{
+  std::vector<Sample> samples = SamplePipeline::ReadManifest(f_manifest);
+  for (size_t k = 0; k < samples.size(); k++)
+    {
+      const Sample& s = samples[k];
+      Override o;
+      o.pattern = CanonicalPath(s.scan);
+      o.exact = true;
+      std::ostringstream Fm, T;
+      Fm.precision(17);
+      T.precision(17);
+      Fm << s.Fm;
+      T << s.T;
+      o.values.push_back(std::make_pair(std::string("type"), std::string("fmscan")));
+      o.values.push_back(std::make_pair(std::string("sample"), s.name));
+      o.values.push_back(std::make_pair(std::string("Fm"), Fm.str()));
+      o.values.push_back(std::make_pair(std::string("T"), T.str()));
+      o.values.push_back(std::make_pair(std::string("calib"), s.calib));
+      o.values.push_back(std::make_pair(std::string("di"), s.di));
+      o.values.push_back(std::make_pair(std::string("do"), s.dout));
+      fOverrides.push_back(o);
+    }
+}
+
+inline void ArchiveWriter::AddOverrides(const char* f_overrides)
+{
+  std::ifstream in(f_overrides);
+  if (!in)
+    {
+      std::cerr << "ArchiveWriter: cannot open " << f_overrides << std::endl;
+      return;
+    }
+  std::string line;
+  while (std::getline(in, line))
+    {
+      size_t first = line.find_first_not_of(" \t\r");
+      if (first == std::string::npos || line[first] == '#') continue;
+      std::istringstream fields(line);
+      Override o;
+      o.exact = false;
+      fields >> o.pattern;
+      std::string kv;
+      while (fields >> kv)
+	{
+	  size_t eq = kv.find('=');
+	  if (eq == std::string::npos) continue;
+	  o.values.push_back(std::make_pair(kv.substr(0, eq), kv.substr(eq + 1)));
+	}
+      fOverrides.push_back(o);
+    }
+}
+
+inline int ArchiveWriter::AddDirectory(const std::string& dir)
+{
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    {
+      std::cerr << "ArchiveWriter: cannot open directory " << dir << std::endl;
+      return 0;
+    }
+  /*Sorted, so the same tree always gives the same archive*/
+  std::vector<std::string> names;
+  for (struct dirent* ent = readdir(d); ent; ent = readdir(d))
+    if (ent->d_name[0] != '.') names.push_back(ent->d_name);
+  closedir(d);
+  std::sort(names.begin(), names.end());
+
+  int nadded = 0;
+  for (size_t k = 0; k < names.size(); k++)
+    {
+      const std::string path = dir + "/" + names[k];
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0) continue;
+      if (S_ISDIR(st.st_mode))
+	{
+	  nadded += AddDirectory(path);
+	  continue;
+	}
+      const std::string ext = Lower(names[k].substr(names[k].rfind('.') == std::string::npos ? names[k].size() : names[k].rfind('.')));
+      if (ext == ".ods")
+	fNSkipped++;
+      else if (ext == ".txt" || ext == ".csv" || ext.empty())
+	nadded += AddFile(path) ? 1 : 0;
+    }
+  return nadded;
+}
+
+/*
+ * Number of columns of the first data row, 0 if
+ * there is none. names is filled from the header
+ * line above that row if it names every column.
+ */
+inline int ArchiveWriter::ReadLayout(const char* text, size_t size, std::vector<std::string>& names)
+{
+  const char* end = text + size;
+  std::string header;
+  int ncol = 0;
+  for (const char* p = text; p < end && ncol == 0; )
+    {
+      const char* eol = (const char*)memchr(p, '\n', end - p);
+      if (!eol) eol = end;
+      double values[64];
+      if (DataFile::ParseLine(p, eol, 1, values) > 0)
+	{
+	  while (ncol < 64 && DataFile::ParseLine(p, eol, ncol + 1, values) > 0) ncol++;
+	}
+      else
+	{
+	  /*Skip blank and ",,,," lines so the header is the last line with words*/
+	  for (const char* q = p; q < eol; q++)
+	    if (isalpha((unsigned char)*q))
+	      {
+		header.assign(p, eol);
+		break;
+	      }
+	}
+      p = eol + 1;
+    }
+  names.clear();
+  if (ncol == 0) return 0;
+
+  /*ROOT layouts split on ':', comment headers on ','*/
+  size_t first = header.find_first_not_of("# \t");
+  header = first == std::string::npos ? std::string() : header.substr(first);
+  const char sep = header.find(':') != std::string::npos ? ':' : ',';
+  std::vector<std::string> fields;
+  std::istringstream in(header);
+  std::string field;
+  while (std::getline(in, field, sep))
+    {
+      size_t slash = field.find('/');
+      if (slash != std::string::npos) field.erase(slash);
+      size_t a = field.find_first_not_of(" \t\r"), b = field.find_last_not_of(" \t\r");
+      field = a == std::string::npos ? std::string() : field.substr(a, b - a + 1);
+      for (size_t i = 0; i < field.size(); i++)
+	if (!isalnum((unsigned char)field[i]) && field[i] != '_') field[i] = '_';
+      fields.push_back(field.substr(0, 31));
+    }
+  /*Spreadsheet exports pad the header with empty cells*/
+  while ((int)fields.size() > ncol && fields.back().empty()) fields.pop_back();
+  bool named = (int)fields.size() == ncol;
+  for (int i = 0; named && i < ncol; i++)
+    named = !fields[i].empty() && !isdigit((unsigned char)fields[i][0])
+      && std::count(fields.begin(), fields.end(), fields[i]) == 1;
+  if (named) names = fields;
+  return ncol;
+}
+
+/*The DAQ and analysis layouts, or c0, c1, ...*/
+inline void ArchiveWriter::DefaultLayout(const std::string& type, int ncol, std::vector<std::string>& names)
+{
+  static const char* kScan[] = { "t", "I", "B" };
+  static const char* kBvz[] = { "z", "B", "B_err", "I", "I_err" };
+  static const char* kResults6[] = { "Bext", "sig_Bext", "ur", "sig_ur", "sig_ur_pp", "sig_ur_corr" };
+  static const char* kResults8[] = { "Bext", "sig_Bext", "Bi", "sig_Bi", "ur", "sig_ur", "sig_ur_pp", "sig_ur_corr" };
+  const char** layout = 0;
+  if (ncol == 3 && (type == "calibration" || type == "fmscan" || type == "offset")) layout = kScan;
+  else if (ncol == 5 && type == "bvz") layout = kBvz;
+  else if (ncol == 6 && type == "results") layout = kResults6;
+  else if (ncol == 8 && type == "results") layout = kResults8;
+  names.clear();
+  for (int i = 0; i < ncol; i++)
+    {
+      char name[16];
+      snprintf(name, sizeof(name), "c%d", i);
+      names.push_back(ncol == 1 && type == "geometry" ? std::string("d") : layout ? std::string(layout[i]) : std::string(name));
+    }
+}
+
+inline bool ArchiveWriter::AddFile(const std::string& f_data)
+{
+  if (!fDat) return false;
+  struct stat st;
+  if (stat(f_data.c_str(), &st) != 0 || st.st_size == 0)
+    {
+      fNSkipped++;
+      return false;
+    }
+  std::vector<std::string> names;
+  int fd = open(f_data.c_str(), O_RDONLY);
+  if (fd < 0)
+    {
+      fNSkipped++;
+      return false;
+    }
+  void* text = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED)
+    {
+      fNSkipped++;
+      return false;
+    }
+  const int ncol = ReadLayout((const char*)text, (size_t)st.st_size, names);
+  munmap(text, (size_t)st.st_size);
+  if (ncol == 0)
+    {
+      fNSkipped++;
+      return false;
+    }
+  const std::string type = Classify(BaseName(f_data), ncol);
+  if (names.empty()) DefaultLayout(type, ncol, names);
+
+  std::string layout;
+  for (size_t i = 0; i < names.size(); i++) layout += (i ? ":" : "") + names[i];
+  DataFile Data(f_data.c_str(), layout.c_str(), false);
+  if (!Data.IsOpen() || Data.GetN() == 0)
+    {
+      fNSkipped++;
+      return false;
+    }
+
+  ArchiveEntry e;
+  e.id = (int)fEntries.size();
+  e.type = type;
+  e.path = f_data;
+  e.columns = names;
+  e.nrows = Data.GetN();
+  Describe(e);
+
+  std::string buf;
+  for (int col = 0; col < Data.GetNColumns(); col++)
+    {
+      const double* v = Data.GetColumn(col);
+      for (long first = 0, k = 0; first < e.nrows; first += kChunkRows, k++)
+	{
+	  ArchiveChunk c;
+	  c.col = col;
+	  c.chunk = k;
+	  c.nrows = std::min(kChunkRows, e.nrows - first);
+	  c.min = HUGE_VAL;
+	  c.max = -HUGE_VAL;
+	  for (long i = first; i < first + c.nrows; i++)
+	    {
+	      c.min = std::min(c.min, v[i]);
+	      c.max = std::max(c.max, v[i]);
+	    }
+	  buf.clear();
+	  c.exp = ColumnCodec::Encode(c.nrows, v + first, buf);
+	  c.offset = fOffset;
+	  c.bytes = buf.size();
+	  if (fwrite(buf.data(), 1, buf.size(), fDat) != buf.size())
+	    {
+	      std::cerr << "ArchiveWriter: write failed for " << fName << ".dat" << std::endl;
+	      fclose(fDat);
+	      fDat = 0;
+	      return false;
+	    }
+	  fOffset += buf.size();
+	  e.chunks.push_back(c);
+	}
+    }
+  fEntries.push_back(e);
+  fTextBytes += (uint64_t)st.st_size;
+  fRows += e.nrows;
+  return true;
+}
+
+inline std::string ArchiveWriter::Classify(const std::string& base, int ncol)
+{
+  const std::string f = Lower(base);
+  if (Contains(f, "results") || Contains(f, "uvb") || Contains(f, "ur_v") || Contains(f, "mu_")
+      || Contains(f, "uncertainties") || Contains(f, "_err")) return "results";
+  if (Contains(f, "bvsx") || Contains(f, "xscan") || Contains(f, "bvsz_")) return "map";
+  if (Contains(f, "bvz") || Contains(f, "b_vs_z") || Contains(f, "bz_scan") || Contains(f, "helmholtz_map")) return "bvz";
+  if (Contains(f, "calib")) return "calibration";
+  if (Contains(f, "offset") || Contains(f, "magnetization") || Contains(f, "initial_mag")) return "offset";
+  if (f == "ri.txt" || f == "ro.txt" || Contains(f, "_di.") || Contains(f, "_do.") || Contains(f, "diameter")
+      || Contains(f, "thickness")) return "geometry";
+  if (ncol == 5) return "bvz";
+  if (ncol == 3) return "fmscan";
+  return "other";
+}
+
+inline std::string ArchiveWriter::FindDate(const std::string& path)
+{
+  char date[40];
+  int y, m, d;
+  const std::string base = BaseName(path);
+  /*DataFile_YYMMDD_HHMMSS*.txt from the DAQ*/
+  if (sscanf(base.c_str(), "DataFile_%2d%2d%2d", &y, &m, &d) == 3 || sscanf(base.c_str(), "Data_%4d_%2d_%2d", &y, &m, &d) == 3)
+    {
+      snprintf(date, sizeof(date), "%04d-%02d-%02d", y < 100 ? 2000 + y : y, m, d);
+      return date;
+    }
+  /*M-D-YY_ campaign directories, the innermost one wins*/
+  std::string dir = DirName(path);
+  while (!dir.empty() && dir != ".")
+    {
+      char tail;
+      if (sscanf(BaseName(dir).c_str(), "%d-%d-%d%c", &m, &d, &y, &tail) == 4 && tail == '_' && m >= 1 && m <= 12)
+	{
+	  snprintf(date, sizeof(date), "%04d-%02d-%02d", 2000 + y, m, d);
+	  return date;
+	}
+      if (dir.find('/') == std::string::npos) break;
+      dir = DirName(dir);
+    }
+  return std::string();
+}
+
+inline double ArchiveWriter::FindTemperature(const std::string& path)
+{
+  /*The file name first, then the directories; one naming both (cryo_v_room) says nothing*/
+  std::string part = path;
+  while (!part.empty())
+    {
+      const std::string f = Lower(BaseName(part));
+      const bool cold = Contains(f, "cryo") || Contains(f, "ln2") || Contains(f, "liquid nitrogen");
+      const bool warm = Contains(f, "room") || Contains(f, "warm");
+      if (cold != warm) return cold ? 77.0 : 295.0;
+      if (part.find('/') == std::string::npos) break;
+      part = DirName(part);
+    }
+  return 295.0;
+}
+
+inline void ArchiveWriter::SetGeometry(ArchiveEntry& e, const std::string& f_inner, const std::string& f_outer)
+{
+  const DiameterStats in = SamplePipeline::ReadDiameters(f_inner), out = SamplePipeline::ReadDiameters(f_outer);
+  if (in.mean <= 0 || out.mean <= 0) return;
+  const Geometry g = SamplePipeline::MakeGeometry(in, out);
+  e.r_in = in.mean;
+  e.r_out = out.mean;
+  e.R = g.R;
+  e.R_sig = g.R_sig;
+}
+
+/*
+ * Steel mass fraction from one file or directory
+ * name: NN_MM_ with NN + MM = 100 starting the name
+ * or following an '_'. nan if the name has none.
+ */
+inline double ArchiveWriter::FindFm(const std::string& name)
+{
+  for (size_t i = 0; i < name.size(); i++)
+    {
+      if (i > 0 && name[i - 1] != '_') continue;
+      int a, b;
+      char tail;
+      if (sscanf(name.c_str() + i, "%2d_%2d%c", &a, &b, &tail) == 3 && tail == '_' && a + b == 100)
+	return a / 100.0;
+    }
+  return NAN;
+}
+
+/*
+ * Steel volume fraction from one file or directory
+ * name: a word fv0.NN or fNN (fv40 too) starting
+ * the name or following an '_'. nan if none.
+ */
+inline double ArchiveWriter::FindFv(const std::string& name)
+{
+  const std::string f = Lower(name);
+  for (size_t i = 0; i < f.size(); i++)
+    {
+      if ((i > 0 && f[i - 1] != '_') || f[i] != 'f') continue;
+      const size_t first = f[i + 1] == 'v' ? i + 2 : i + 1;
+      size_t end = first;
+      while (end < f.size() && (isdigit((unsigned char)f[end]) || f[end] == '.')) end++;
+      while (end > first && f[end - 1] == '.') end--;
+      if (end == first || (end < f.size() && f[end] != '_' && f[end] != '.')) continue;
+      const std::string number = f.substr(first, end - first);
+      const double x = strtod(number.c_str(), 0);
+      if (number.find('.') != std::string::npos && x > 0 && x <= 1) return x;
+      if (number.find('.') == std::string::npos && number.size() == 2 && x > 0) return x / 100.0;
+    }
+  return NAN;
+}
+
+/*find on the file name, then on each directory above it, until one gives a value*/
+inline double ArchiveWriter::FindNearest(const std::string& path, double (*find)(const std::string&))
+{
+  std::string part = path;
+  while (!part.empty())
+    {
+      const double x = find(BaseName(part));
+      if (!std::isnan(x)) return x;
+      if (part.find('/') == std::string::npos) break;
+      part = DirName(part);
+    }
+  return NAN;
+}
+
+inline void ArchiveWriter::Describe(ArchiveEntry& e) const
+{
+  const std::string dir = DirName(e.path);
+  const std::string f = Lower(e.path);
+  e.sample = BaseName(dir);
+  e.date = FindDate(e.path);
+  e.T = FindTemperature(e.path);
+
+  e.material = "";
+  static const char* kMaterials[][2] = { { "epoxy", "epoxy" }, { "powder", "powder" }, { "sheet", "sheet" },
+					 { "steel302", "stainless_302" }, { "steel_302", "stainless_302" }, { "wax", "wax" }, { "purefm", "pure" } };
+  for (int k = 0; k < 7 && e.material.empty(); k++)
+    if (Contains(f, kMaterials[k][0])) e.material = kMaterials[k][1];
+
+  /*The steel fractions from the file name or the nearest directory naming them*/
+  e.Fm = FindNearest(e.path, FindFm);
+  e.fv = FindNearest(e.path, FindFv);
+
+  e.r_in = e.r_out = e.R = e.R_sig = NAN;
+  struct stat st;
+  if (stat((dir + "/ri.txt").c_str(), &st) == 0 && stat((dir + "/ro.txt").c_str(), &st) == 0)
+    SetGeometry(e, dir + "/ri.txt", dir + "/ro.txt");
+
+  /*Manifest entries match the whole path, overrides a part of it*/
+  const std::string canonical = CanonicalPath(e.path);
+  std::string f_di, f_do;
+  for (size_t k = 0; k < fOverrides.size(); k++)
+    {
+      const Override& o = fOverrides[k];
+      if (o.exact ? canonical != o.pattern : e.path.find(o.pattern) == std::string::npos) continue;
+      for (size_t v = 0; v < o.values.size(); v++)
+	{
+	  if (o.values[v].first == "di") f_di = o.values[v].second;
+	  else if (o.values[v].first == "do") f_do = o.values[v].second;
+	  else Apply(e, o.values[v].first, o.values[v].second);
+	}
+    }
+  if (!f_di.empty() && !f_do.empty()) SetGeometry(e, f_di, f_do);
+}
+
+inline void ArchiveWriter::Apply(ArchiveEntry& e, const std::string& key, const std::string& value)
+{
+  if (key == "type") e.type = value;
+  else if (key == "sample") e.sample = value;
+  else if (key == "material") e.material = value;
+  else if (key == "date") e.date = value;
+  else if (key == "calib") e.calib = value;
+  else if (key == "Fm") e.Fm = strtod(value.c_str(), 0);
+  else if (key == "fv") e.fv = strtod(value.c_str(), 0);
+  else if (key == "T") e.T = strtod(value.c_str(), 0);
+  else if (key == "r_in") e.r_in = strtod(value.c_str(), 0);
+  else if (key == "r_out") e.r_out = strtod(value.c_str(), 0);
+  else if (key == "R") e.R = strtod(value.c_str(), 0);
+  else if (key == "R_sig") e.R_sig = strtod(value.c_str(), 0);
+  else std::cerr << "ArchiveWriter: unknown key " << key << std::endl;
+}
+
+inline bool ArchiveWriter::Close()
+{
+  if (!fDat) return false;
+  bool ok = fclose(fDat) == 0;
+  fDat = 0;
+
+  /*
+   * Write to temporary files and rename, data file
+   * first. Archive() checks the generation in both.
+   */
+  const std::string f_idx = fName + ".idx", f_dat = fName + ".dat";
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char generation[64];
+  snprintf(generation, sizeof(generation), "%ld.%09ld.%ld", (long)now.tv_sec, (long)now.tv_nsec, (long)getpid());
+  const std::string trailer = std::string("#FMARCv3\t") + generation + "\n";
+  FILE* dat = ok ? fopen((f_dat + ".tmp").c_str(), "ab") : 0;
+  ok = dat != 0 && fwrite(trailer.data(), 1, trailer.size(), dat) == trailer.size();
+  if (dat) ok = (fclose(dat) == 0) && ok;
+  FILE* out = ok ? fopen((f_idx + ".tmp").c_str(), "w") : 0;
+  ok = out != 0;
+  if (ok)
+    {
+      fprintf(out, "#FMARCv3\t%lu\t%lu\t%s\n", (unsigned long)fEntries.size(),
+	      (unsigned long)(fOffset + trailer.size()), generation);
+      for (size_t k = 0; k < fEntries.size(); k++)
+	{
+	  const ArchiveEntry& e = fEntries[k];
+	  std::string columns;
+	  for (size_t i = 0; i < e.columns.size(); i++) columns += (i ? ":" : "") + e.columns[i];
+	  fprintf(out, "S\t%d\t%s\t%s\t%s\t%.17g\t%.17g\t%.17g\t%s\t%.17g\t%.17g\t%.17g\t%.17g\t%ld\t%s\t%s\t%s\n",
+		  e.id, e.type.c_str(), e.sample.empty() ? "-" : e.sample.c_str(),
+		  e.material.empty() ? "-" : e.material.c_str(), e.Fm, e.fv, e.T, e.date.empty() ? "-" : e.date.c_str(),
+		  e.r_in, e.r_out, e.R, e.R_sig, e.nrows, e.calib.empty() ? "-" : e.calib.c_str(),
+		  columns.c_str(), e.path.c_str());
+	  for (size_t c = 0; c < e.chunks.size(); c++)
+	    fprintf(out, "K\t%d\t%d\t%ld\t%ld\t%lu\t%lu\t%d\t%.17g\t%.17g\n", e.id, e.chunks[c].col, e.chunks[c].chunk,
+		    e.chunks[c].nrows, (unsigned long)e.chunks[c].offset, (unsigned long)e.chunks[c].bytes,
+		    e.chunks[c].exp, e.chunks[c].min, e.chunks[c].max);
+	}
+      ok = (fclose(out) == 0) && ok;
+    }
+  if (ok) ok = rename((f_dat + ".tmp").c_str(), f_dat.c_str()) == 0 && rename((f_idx + ".tmp").c_str(), f_idx.c_str()) == 0;
+  if (!ok)
+    {
+      std::cerr << "ArchiveWriter: cannot write " << fName << std::endl;
+      remove((f_dat + ".tmp").c_str());
+      remove((f_idx + ".tmp").c_str());
+    }
+  return ok;
+}
+
+/*
+ * The Archive class reads the index of an archive
+ * and answers queries from it. Load() maps only
+ * the chunks of the series (and, with column
+ * ranges, only the chunks that can match) from
+ * the data file and decodes them; nothing else of
+ * the archive is read.
+ */
+class Archive
+{
+ public:
+  Archive(const char* f_archive);
+  ~Archive() { if (fFd >= 0) close(fFd); }
+
+  bool IsOpen() const { return fFd >= 0; }
+  int GetNSeries() const { return (int)fEntries.size(); }
+  const ArchiveEntry& GetEntry(int id) const { return fEntries[id]; }
+
+  /*Ids of the matching series, in archive order*/
+  std::vector<int> Select(const ArchiveQuery& q) const
+  {
+    std::vector<int> ids;
+    for (size_t k = 0; k < fEntries.size(); k++)
+      if (q.Match(fEntries[k])) ids.push_back((int)k);
+    return ids;
+  }
+
+  ArchiveColumns Load(int id, const ArchiveQuery& q = ArchiveQuery()) const;
+  /*Load several series on nthreads threads (0 = all cores)*/
+  std::vector<ArchiveColumns> Load(const std::vector<int>& ids, const ArchiveQuery& q = ArchiveQuery(), int nthreads = 0) const;
+
+  /*
+   * The calibration of a scan: the one named in the
+   * manifest, or else the latest calibration in the
+   * same directory taken before it (by file name),
+   * or else the first one there. -1 if none.
+   */
+  int FindCalibration(int id) const;
+
+  /*Bytes of the data file mapped by Load() so far*/
+  uint64_t GetMappedBytes() const { return fMapped; }
+
+ private:
+  Archive(const Archive&);
+  Archive& operator=(const Archive&);
+
+  bool Open(bool last);
+  static bool CheckChunks(const ArchiveEntry& e, uint64_t dat_bytes);
+
+  std::string fName;
+  int fFd;
+  std::vector<ArchiveEntry> fEntries;
+  mutable std::atomic<uint64_t> fMapped;
+};
+
+inline Archive::Archive(const char* f_archive)
+  : fName(f_archive), fFd(-1), fMapped(0)
+{
+  /*A writer replaces the data file just before the index: then the index is read again*/
+  for (int attempt = 0; attempt < 10 && fFd < 0; attempt++)
+    {
+      if (attempt) usleep(10000);
+      if (!Open(attempt == 9)) return;
+    }
+}
+
+/*
+ * Read the index and open the data file it names.
+ * False if either cannot be read; true with the
+ * data file left closed if it is not the one the
+ * index was written with (reported if last).
+ */
+inline bool Archive::Open(bool last)
+{
+  fEntries.clear();
+  const std::string f_idx = fName + ".idx", f_dat = fName + ".dat";
+  std::ifstream in(f_idx.c_str());
+  std::string line;
+  if (!in || !std::getline(in, line) || line.compare(0, 9, "#FMARCv3\t") != 0)
+    {
+      std::cerr << "Archive: cannot read index " << f_idx << " (written by an older version? ingest again)" << std::endl;
+      return false;
+    }
+  std::istringstream header(line.substr(9));
+  unsigned long nseries = 0, dat_bytes = 0;
+  std::string generation;
+  if (!(header >> nseries >> dat_bytes >> generation))
+    {
+      std::cerr << "Archive: bad header in " << f_idx << std::endl;
+      return false;
+    }
+  while (std::getline(in, line))
+    {
+      std::vector<std::string> f;
+      std::istringstream fields(line);
+      std::string field;
+      while (std::getline(fields, field, '\t')) f.push_back(field);
+      if (f.size() == 17 && f[0] == "S")
+	{
+	  ArchiveEntry e;
+	  e.id = atoi(f[1].c_str());
+	  e.type = f[2];
+	  e.sample = f[3] == "-" ? std::string() : f[3];
+	  e.material = f[4] == "-" ? std::string() : f[4];
+	  e.Fm = strtod(f[5].c_str(), 0);
+	  e.fv = strtod(f[6].c_str(), 0);
+	  e.T = strtod(f[7].c_str(), 0);
+	  e.date = f[8] == "-" ? std::string() : f[8];
+	  e.r_in = strtod(f[9].c_str(), 0);
+	  e.r_out = strtod(f[10].c_str(), 0);
+	  e.R = strtod(f[11].c_str(), 0);
+	  e.R_sig = strtod(f[12].c_str(), 0);
+	  e.nrows = atol(f[13].c_str());
+	  e.calib = f[14] == "-" ? std::string() : f[14];
+	  std::istringstream names(f[15]);
+	  std::string name;
+	  while (std::getline(names, name, ':')) e.columns.push_back(name);
+	  e.path = f[16];
+	  if (e.id != (int)fEntries.size()) break;
+	  fEntries.push_back(e);
+	}
+      else if (f.size() == 10 && f[0] == "K" && !fEntries.empty())
+	{
+	  ArchiveChunk c;
+	  c.col = atoi(f[2].c_str());
+	  c.chunk = atol(f[3].c_str());
+	  c.nrows = atol(f[4].c_str());
+	  c.offset = strtoull(f[5].c_str(), 0, 10);
+	  c.bytes = strtoull(f[6].c_str(), 0, 10);
+	  c.exp = atoi(f[7].c_str());
+	  c.min = strtod(f[8].c_str(), 0);
+	  c.max = strtod(f[9].c_str(), 0);
+	  /*A chunk of another series leaves this one short, so CheckChunks() drops it*/
+	  if (atoi(f[1].c_str()) == fEntries.back().id) fEntries.back().chunks.push_back(c);
+	}
+      else
+	{
+	  std::cerr << "Archive: bad index line in " << f_idx << ": " << line << std::endl;
+	  fEntries.clear();
+	  return false;
+	}
+    }
+
+  if (fEntries.size() != nseries)
+    {
+      std::cerr << "Archive: " << f_idx << " lists " << fEntries.size() << " of " << nseries << " series" << std::endl;
+      fEntries.clear();
+      return false;
+    }
+
+  const int fd = open(f_dat.c_str(), O_RDONLY);
+  if (fd < 0)
+    {
+      std::cerr << "Archive: cannot open " << f_dat << std::endl;
+      fEntries.clear();
+      return false;
+    }
+  const std::string trailer = "#FMARCv3\t" + generation + "\n";
+  std::string tail(trailer.size(), '\0');
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (unsigned long)st.st_size != dat_bytes || dat_bytes < trailer.size()
+      || pread(fd, &tail[0], tail.size(), (off_t)(dat_bytes - trailer.size())) != (ssize_t)tail.size() || tail != trailer)
+    {
+      close(fd);
+      fEntries.clear();
+      if (last) std::cerr << "Archive: " << f_dat << " does not belong to " << f_idx << std::endl;
+      return true;
+    }
+  fFd = fd;
+
+  /*Drop the series whose chunks do not cover them, so queries can index chunks unchecked*/
+  size_t kept = 0;
+  for (size_t k = 0; k < fEntries.size(); k++)
+    {
+      if (!CheckChunks(fEntries[k], dat_bytes - trailer.size()))
+	{
+	  std::cerr << "Archive: bad chunk list for " << fEntries[k].path << " in " << f_idx << ", series left out" << std::endl;
+	  continue;
+	}
+      fEntries[kept] = fEntries[k];
+      fEntries[kept].id = (int)kept;
+      kept++;
+    }
+  fEntries.resize(kept);
+  return true;
+}
+
+/*
+ * Whether the chunks of e are the ncol x nchunks
+ * of Close(), column by column, each of the right
+ * length and inside the data file.
+ */
+inline bool Archive::CheckChunks(const ArchiveEntry& e, uint64_t dat_bytes)
+{
+  const long nchunks = (e.nrows + kChunkRows - 1) / kChunkRows;
+  const long ncol = (long)e.columns.size();
+  if (e.nrows < 0 || (long)e.chunks.size() != ncol * nchunks) return false;
+  for (long col = 0; col < ncol; col++)
+    for (long k = 0; k < nchunks; k++)
+      {
+	const ArchiveChunk& c = e.chunks[col * nchunks + k];
+	if (c.col != col || c.chunk != k || c.nrows != std::min(kChunkRows, e.nrows - k * kChunkRows)
+	    || c.offset > dat_bytes || c.bytes > dat_bytes - c.offset) return false;
+      }
+  return true;
+}
+
+inline ArchiveColumns Archive::Load(int id, const ArchiveQuery& q) const
+{
+  ArchiveColumns out;
+  if (fFd < 0 || id < 0 || id >= (int)fEntries.size()) return out;
+  const ArchiveEntry& e = fEntries[id];
+  const long nchunks = (e.nrows + kChunkRows - 1) / kChunkRows;
+  const int ncol = (int)e.columns.size();
+
+  /*Chunks the column ranges leave in, and where their rows go*/
+  std::vector<long> first(nchunks + 1, 0);
+  std::vector<bool> keep(nchunks);
+  for (long k = 0; k < nchunks; k++)
+    {
+      keep[k] = q.ranges.empty() || q.MatchChunk(e, k);
+      first[k + 1] = first[k] + (keep[k] ? e.chunks[k].nrows : 0);
+    }
+  const long n = first[nchunks];
+  out.fId = id;
+  out.fNames = e.columns;
+  out.fData.resize(n * ncol);
+  out.fN = n;
+
+  /*Map each run of kept chunks of a column at once*/
+  const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+  bool ok = true;
+  for (int col = 0; col < ncol && ok; col++)
+    for (long k = 0; k < nchunks && ok; )
+      {
+	if (!keep[k]) { k++; continue; }
+	long last = k;
+	while (last + 1 < nchunks && keep[last + 1]) last++;
+	const ArchiveChunk& c0 = e.chunks[col * nchunks + k];
+	const ArchiveChunk& c1 = e.chunks[col * nchunks + last];
+	const uint64_t start = c0.offset / page * page, stop = c1.offset + c1.bytes;
+	if (stop == start)
+	  {
+	    k = last + 1;
+	    continue;
+	  }
+	void* map = mmap(0, stop - start, PROT_READ, MAP_PRIVATE, fFd, (off_t)start);
+	if (map == MAP_FAILED)
+	  {
+	    std::cerr << "Archive: cannot map " << fName << ".dat" << std::endl;
+	    ok = false;
+	    break;
+	  }
+	fMapped += stop - start;
+	for (long j = k; j <= last && ok; j++)
+	  {
+	    const ArchiveChunk& c = e.chunks[col * nchunks + j];
+	    ok = ColumnCodec::Decode((const char*)map + (c.offset - start), c.bytes, c.nrows, c.exp,
+				     &out.fData[col * n + first[j]]);
+	  }
+	munmap(map, stop - start);
+	if (!ok) std::cerr << "Archive: corrupt chunk in " << e.path << std::endl;
+	k = last + 1;
+      }
+  if (!ok)
+    {
+      out.fData.clear();
+      out.fN = 0;
+      return out;
+    }
+
+  /*Inside the kept chunks, drop the rows outside the ranges*/
+  if (!q.ranges.empty())
+    {
+      std::vector<const double*> cols(ncol);
+      for (int col = 0; col < ncol; col++) cols[col] = &out.fData[col * n];
+      long m = 0;
+      for (long i = 0; i < n; i++)
+	{
+	  if (!q.MatchRow(e, cols, i)) continue;
+	  for (int col = 0; col < ncol; col++) out.fData[col * n + m] = out.fData[col * n + i];
+	  m++;
+	}
+      std::vector<double> packed(m * ncol);
+      for (int col = 0; col < ncol; col++)
+	std::copy(out.fData.begin() + col * n, out.fData.begin() + col * n + m, packed.begin() + col * m);
+      out.fData.swap(packed);
+      out.fN = m;
+    }
+  out.fOpen = true;
+  return out;
+}
+
+inline std::vector<ArchiveColumns> Archive::Load(const std::vector<int>& ids, const ArchiveQuery& q, int nthreads) const
+{
+  std::vector<ArchiveColumns> results(ids.size());
+  if (nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+  nthreads = std::min<int>(nthreads, std::max<size_t>(ids.size(), 1));
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < nthreads; t++)
+    workers.push_back(std::thread([this, &ids, &q, &results, &next]()
+      {
+	for (size_t i = next++; i < ids.size(); i = next++) results[i] = Load(ids[i], q);
+      }));
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+  return results;
+}
+
+inline int Archive::FindCalibration(int id) const
+{
+  const ArchiveEntry& e = fEntries[id];
+  if (!e.calib.empty())
+    {
+      const std::string calib = ArchiveWriter::CanonicalPath(e.calib);
+      for (size_t k = 0; k < fEntries.size(); k++)
+	if (fEntries[k].path == e.calib || ArchiveWriter::CanonicalPath(fEntries[k].path) == calib) return (int)k;
+    }
+  const std::string dir = e.GetDirectory(), base = e.path.substr(dir.size());
+  int best = -1, first = -1;
+  for (size_t k = 0; k < fEntries.size(); k++)
+    {
+      const ArchiveEntry& c = fEntries[k];
+      if (c.type != "calibration" || c.GetDirectory() != dir || c.GetColumnIndex("I") < 0 || c.GetColumnIndex("B") < 0) continue;
+      const std::string c_base = c.path.substr(dir.size());
+      if (first < 0 || c_base < fEntries[first].path.substr(dir.size())) first = (int)k;
+      if (c_base <= base && (best < 0 || c_base > fEntries[best].path.substr(dir.size()))) best = (int)k;
+    }
+  return best >= 0 ? best : first;
+}
+
+#endif
@@ -0,0 +1,430 @@
+/*
+ * DAQ Data File Column Reader
+ *
+ * To read the tab separated DataFile_*.txt
+ * files written by the DAQ straight into
+ * contiguous column arrays, replacing the
+ * TTree::ReadFile + Draw("goff") round trip.
+ * To use in a macro: #include "DataFile.h"
+ */
+#ifndef DATAFILE_H
+#define DATAFILE_H
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The DataFile class memory maps a text data
+ * file and parses it into one array per column.
+ * The column layout is given the same way as for
+ * TTree::ReadFile, e.g. "t/D:I:B" for calibration
+ * and ferromagnet scans or "z:B:B_err:I:I_err"
+ * for B vs z scans (type suffixes are ignored,
+ * every column is read as a double).
+ *
+ * After the first parse a binary column cache is
+ * written next to the text file, one per layout
+ * (<file>.<hash of the column names>.col), so a
+ * file read with two layouts keeps two caches. It
+ * is only used while the size and modification
+ * time (to the nanosecond) of the text file are
+ * unchanged, and is memory mapped so later runs
+ * read it zero-copy.
+ *
+ * Blank lines and lines starting with '#' are
+ * skipped, as are lines with too few columns.
+ */
+class DataFile
+{
+ public:
+  DataFile(const char* f_data, const char* layout, bool use_cache = true);
+  ~DataFile();
+
+  bool IsOpen() const { return fOpen; }
+  bool IsFromCache() const { return fCacheMap != 0; }
+  int GetN() const { return fN; }
+  int GetNColumns() const { return (int)fNames.size(); }
+  int GetNSkipped() const { return fNSkipped; }
+  const char* GetColumnName(int i) const { return fNames[i].c_str(); }
+  int GetColumnIndex(const char* name) const;
+  /*Returns 0 for an unknown column*/
+  const double* GetColumn(int i) const;
+  const double* GetColumn(const char* name) const;
+
+  /*Cache file of f_data read with layout*/
+  static std::string CacheName(const char* f_data, const char* layout)
+  {
+    std::vector<std::string> names;
+    SplitLayout(layout, names);
+    return CacheName(f_data, names);
+  }
+
+  /*
+   * Parse one line [begin, end) into ncol values.
+   * Returns 1 for a data row, 0 for a blank or
+   * comment line and -1 for a malformed line.
+   */
+  static int ParseLine(const char* begin, const char* end, int ncol, double* values);
+
+ private:
+  DataFile(const DataFile&);
+  DataFile& operator=(const DataFile&);
+
+  struct CacheHeader
+  {
+    char     magic[8];
+    uint64_t src_size;
+    int64_t  src_mtime;
+    int64_t  src_mtime_ns;
+    uint32_t ncol;
+    uint32_t name_len;
+    uint64_t nrow;
+  };
+  static const uint32_t kNameLen = 32;
+
+  static void SplitLayout(const char* layout, std::vector<std::string>& names);
+  static std::string CacheName(const char* f_data, const std::vector<std::string>& names);
+
+  bool ReadCache(const std::string& f_cache, const struct stat& src);
+  void WriteCache(const std::string& f_cache, const struct stat& src) const;
+  void Parse(const char* text, size_t size);
+
+  static const char* ParseDouble(const char* p, const char* end, double& value);
+
+  std::vector<std::string> fNames;
+  std::vector<const double*> fColumns;
+  std::vector<double> fData;
+  void*  fCacheMap;
+  size_t fCacheSize;
+  int    fN;
+  int    fNSkipped;
+  bool   fOpen;
+};
+
+inline DataFile::DataFile(const char* f_data, const char* layout, bool use_cache)
+  : fCacheMap(0), fCacheSize(0), fN(0), fNSkipped(0), fOpen(false)
+{
+  SplitLayout(layout, fNames);
+  if (fNames.empty())
+    {
+      std::cerr << "DataFile: empty column layout for " << f_data << std::endl;
+      return;
+    }
+
+  struct stat src;
+  if (stat(f_data, &src) != 0)
+    {
+      std::cerr << "DataFile: cannot open " << f_data << std::endl;
+      return;
+    }
+
+  const std::string f_cache = CacheName(f_data, fNames);
+  if (use_cache && ReadCache(f_cache, src))
+    {
+      fOpen = true;
+      return;
+    }
+
+  int fd = open(f_data, O_RDONLY);
+  if (fd < 0)
+    {
+      std::cerr << "DataFile: cannot open " << f_data << std::endl;
+      return;
+    }
+  size_t size = (size_t)src.st_size;
+  if (size > 0)
+    {
+      void* text = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (text == MAP_FAILED)
+	{
+	  std::cerr << "DataFile: cannot map " << f_data << std::endl;
+	  close(fd);
+	  return;
+	}
+      madvise(text, size, MADV_SEQUENTIAL);
+      Parse((const char*)text, size);
+      munmap(text, size);
+    }
+  else
+    {
+      Parse(0, 0);
+    }
+  close(fd);
+  fOpen = true;
+
+  if (fNSkipped > 0)
+    std::cerr << "DataFile: skipped " << fNSkipped << " malformed lines in " << f_data << std::endl;
+  if (use_cache) WriteCache(f_cache, src);
+}
+
+/*Split the layout into column names, dropping any /D type suffix*/
+inline void DataFile::SplitLayout(const char* layout, std::vector<std::string>& names)
+{
+  std::string spec(layout);
+  size_t start = 0;
+  while (start <= spec.size())
+    {
+      size_t stop = spec.find(':', start);
+      if (stop == std::string::npos) stop = spec.size();
+      std::string name = spec.substr(start, stop - start);
+      size_t slash = name.find('/');
+      if (slash != std::string::npos) name.erase(slash);
+      if (!name.empty()) names.push_back(name.substr(0, kNameLen - 1));
+      start = stop + 1;
+    }
+}
+
+/*FNV-1a of the column names, so "t/D:I:B" and "t:I:B" share a cache*/
+inline std::string DataFile::CacheName(const char* f_data, const std::vector<std::string>& names)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < names.size(); i++)
+    for (size_t k = 0; k <= names[i].size(); k++)
+      {
+	hash ^= (unsigned char)names[i].c_str()[k];
+	hash *= 1099511628211ULL;
+      }
+  char key[17];
+  snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+  return std::string(f_data) + "." + key + ".col";
+}
+
+inline DataFile::~DataFile()
+{
+  if (fCacheMap) munmap(fCacheMap, fCacheSize);
+}
+
+inline int DataFile::GetColumnIndex(const char* name) const
+{
+  for (size_t i = 0; i < fNames.size(); i++)
+    if (fNames[i] == name) return (int)i;
+  return -1;
+}
+
+inline const double* DataFile::GetColumn(int i) const
+{
+  if (i < 0 || i >= (int)fColumns.size()) return 0;
+  return fColumns[i];
+}
+
+inline const double* DataFile::GetColumn(const char* name) const
+{
+  int i = GetColumnIndex(name);
+  if (i < 0)
+    {
+      std::cerr << "DataFile: no column named " << name << std::endl;
+      return 0;
+    }
+  return GetColumn(i);
+}
+
+/*
+ * Parse a decimal number. Numbers with at most 19
+ * significant digits and a small power of ten are
+ * converted exactly with a single multiply/divide;
+ * anything else falls back to strtod so results
+ * always match the C library.
+ */
+inline const char* DataFile::ParseDouble(const char* p, const char* end, double& value)
+{
+  static const double kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+  const char* begin = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+  uint64_t mantissa = 0;
+  int ndigits = 0, exp10 = 0;
+  bool any = false;
+  for (; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+    {
+      if (ndigits < 19) { mantissa = mantissa * 10 + (*p - '0'); if (mantissa) ndigits++; }
+      else exp10++;
+    }
+  if (p < end && *p == '.')
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true)
+      if (ndigits < 19) { mantissa = mantissa * 10 + (*p - '0'); if (mantissa) ndigits++; exp10--; }
+  if (!any) return 0;
+  if (p < end && (*p == 'e' || *p == 'E'))
+    {
+      const char* q = p + 1;
+      bool eneg = false;
+      if (q < end && (*q == '-' || *q == '+')) eneg = (*q++ == '-');
+      if (q < end && *q >= '0' && *q <= '9')
+	{
+	  int e = 0;
+	  for (; q < end && *q >= '0' && *q <= '9'; q++) if (e < 10000) e = e * 10 + (*q - '0');
+	  exp10 += eneg ? -e : e;
+	  p = q;
+	}
+    }
+
+  if (mantissa < (uint64_t(1) << 53) && exp10 >= -22 && exp10 <= 22)
+    {
+      value = (double)mantissa;
+      value = exp10 < 0 ? value / kPow10[-exp10] : value * kPow10[exp10];
+    }
+  else
+    {
+      char buf[64];
+      size_t len = (size_t)(p - begin);
+      if (len >= sizeof(buf)) return 0;
+      memcpy(buf, begin, len);
+      buf[len] = '\0';
+      value = strtod(buf, 0);
+      return p;
+    }
+  if (negative) value = -value;
+  return p;
+}
+
+inline int DataFile::ParseLine(const char* begin, const char* end, int ncol, double* values)
+{
+  const char* q = begin;
+  while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == ',')) q++;
+  if (q == end || *q == '#') return 0;
+  for (int icol = 0; icol < ncol; icol++)
+    {
+      q = ParseDouble(q, end, values[icol]);
+      if (!q) return -1;
+      while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == ',')) q++;
+    }
+  return 1;
+}
+
+inline void DataFile::Parse(const char* text, size_t size)
+{
+  const char* end = text + size;
+  /*Count lines first so each column is one contiguous block*/
+  size_t nlines = 0;
+  for (const char* p = text; p < end; p++)
+    {
+      const char* nl = (const char*)memchr(p, '\n', end - p);
+      nlines++;
+      if (!nl) break;
+      p = nl;
+    }
+
+  const size_t ncol = fNames.size();
+  fData.assign(ncol * nlines, 0.0);
+  std::vector<double> row(ncol);
+
+  size_t n = 0;
+  const char* p = text;
+  while (p < end)
+    {
+      const char* eol = (const char*)memchr(p, '\n', end - p);
+      if (!eol) eol = end;
+      const int status = ParseLine(p, eol, (int)ncol, &row[0]);
+      if (status > 0)
+	{
+	  for (size_t i = 0; i < ncol; i++) fData[i * nlines + n] = row[i];
+	  n++;
+	}
+      else if (status < 0)
+	{
+	  fNSkipped++;
+	}
+      p = eol + 1;
+    }
+
+  fN = (int)n;
+  fColumns.resize(ncol);
+  for (size_t i = 0; i < ncol; i++) fColumns[i] = fData.empty() ? 0 : &fData[i * nlines];
+}
+
+inline bool DataFile::ReadCache(const std::string& f_cache, const struct stat& src)
+{
+  int fd = open(f_cache.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader))
+    {
+      close(fd);
+      return false;
+    }
+  size_t size = (size_t)st.st_size;
+  void* map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const CacheHeader* h = (const CacheHeader*)map;
+  const size_t ncol = fNames.size();
+  bool ok = memcmp(h->magic, "FMCOLv2", 8) == 0
+    && h->src_size == (uint64_t)src.st_size
+    && h->src_mtime == (int64_t)src.st_mtim.tv_sec
+    && h->src_mtime_ns == (int64_t)src.st_mtim.tv_nsec
+    && h->ncol == ncol
+    && h->name_len == kNameLen
+    && size == sizeof(CacheHeader) + ncol * kNameLen + ncol * h->nrow * sizeof(double);
+  const char* names = (const char*)map + sizeof(CacheHeader);
+  for (size_t i = 0; ok && i < ncol; i++)
+    ok = strncmp(names + i * kNameLen, fNames[i].c_str(), kNameLen) == 0;
+  if (!ok)
+    {
+      munmap(map, size);
+      return false;
+    }
+
+  fCacheMap = map;
+  fCacheSize = size;
+  fN = (int)h->nrow;
+  const double* data = (const double*)(names + ncol * kNameLen);
+  fColumns.resize(ncol);
+  for (size_t i = 0; i < ncol; i++) fColumns[i] = data + i * h->nrow;
+  return true;
+}
+
+inline void DataFile::WriteCache(const std::string& f_cache, const struct stat& src) const
+{
+  /*Write to a temporary file and rename so readers never see a partial cache*/
+  /*A unique temporary per writer, so threads writing the same cache do not mix*/
+  char tmp_name[4096];
+  snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", f_cache.c_str());
+  int fd = mkstemp(tmp_name);
+  if (fd < 0) return;
+  fchmod(fd, 0644);
+  FILE* out = fdopen(fd, "wb");
+  if (!out)
+    {
+      close(fd);
+      remove(tmp_name);
+      return;
+    }
+
+  CacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "FMCOLv2", 8);
+  h.src_size = (uint64_t)src.st_size;
+  h.src_mtime = (int64_t)src.st_mtim.tv_sec;
+  h.src_mtime_ns = (int64_t)src.st_mtim.tv_nsec;
+  h.ncol = (uint32_t)fNames.size();
+  h.name_len = kNameLen;
+  h.nrow = (uint64_t)fN;
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+  for (size_t i = 0; ok && i < fNames.size(); i++)
+    {
+      char name[kNameLen];
+      memset(name, 0, kNameLen);
+      strncpy(name, fNames[i].c_str(), kNameLen - 1);
+      ok = fwrite(name, kNameLen, 1, out) == 1;
+    }
+  for (size_t i = 0; ok && i < fColumns.size() && fN > 0; i++)
+    ok = fwrite(fColumns[i], sizeof(double), fN, out) == (size_t)fN;
+  ok = (fclose(out) == 0) && ok;
+
+  if (!ok || rename(tmp_name, f_cache.c_str()) != 0) remove(tmp_name);
+}
+
+#endif
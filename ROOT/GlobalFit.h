@@ -0,0 +1,628 @@
+/*
+ * Global Permeability Fit Over All Samples
+ *
+ * To fit every ferromagnet scan at once with
+ * ur = [0]/B_ext + [1], where [0] and [1]
+ * are shared polynomials in Fm (with a
+ * room/LN2 term), and each calibration and
+ * geometry is a constrained nuisance
+ * parameter, giving the full covariance.
+ * To use in a macro: #include "GlobalFit.h"
+ */
+#ifndef GLOBALFIT_H
+#define GLOBALFIT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Pipeline.h"
+
+/*
+ * The GlobalFit class models the field measured
+ * inside sample s at coil current I as
+ *
+ *   B_in = B_ext * 4u / ((u+1)^2 - (u-1)^2 R_s^2)
+ *   B_ext = c0 + c1 I
+ *   u = p0(Fm, T) / B_ext + p1(Fm, T)
+ *
+ * with p0 and p1 linear in the shared parameters:
+ * powers of (Fm - Fm_ref) up to the chosen order,
+ * plus the same powers times a cold flag for LN2
+ * scans. (c0, c1) of every calibration file and R
+ * of every pair of diameter files are nuisance
+ * parameters, constrained by their own fits. Samples
+ * that share a calibration or diameter file share
+ * the nuisance parameter, so their correlation is
+ * kept.
+ *
+ * The chi2 is minimised with Levenberg-Marquardt.
+ * The Jacobian is analytic; each sample's block of
+ * J^T J and J^T r is filled on a pool of threads
+ * and added in sample order, so the result does not
+ * depend on the number of threads. The covariance
+ * is the inverse of J^T J at the minimum.
+ */
+class GlobalFit
+{
+ public:
+  GlobalFit() : fFmOrder(1), fFmRef(0.6), fTCold(150.0), fB_min(1.0),
+		fNGlobal(0), fNFmTerms(0), fNColdTerms(0), fChi2(0), fNPoints(0) {}
+
+  /*Highest power of (Fm - Fm_ref) in p0 and p1*/
+  void SetFmOrder(int order) { fFmOrder = order; }
+  void SetFmReference(double Fm) { fFmRef = Fm; }
+  /*Scans with T below this (K) get the LN2 terms*/
+  void SetColdTemperature(double T) { fTCold = T; }
+  double GetColdTemperature() const { return fTCold; }
+  /*Points with B_ext below this (mT) are left out, as ur diverges there*/
+  void SetMinField(double B_min) { fB_min = B_min; }
+
+  /*Take the scan, calibration and geometry of one pipeline result*/
+  void AddSample(const SampleResult& r);
+
+  /*Returns the number of iterations, or -1 if the fit did not converge*/
+  int Fit(int nthreads = 0, int max_iter = 50);
+
+  int GetNParameters() const { return (int)fPar.size(); }
+  int GetNGlobal() const { return fNGlobal; }
+  int GetNSamples() const { return (int)fSamples.size(); }
+  int GetNPoints() const { return fNPoints; }
+  /*Nuisance parameters are matched by their constraints, so only the shared ones count*/
+  int GetNDF() const { return fNPoints - fNGlobal; }
+  double GetChi2() const { return fChi2; }
+  double GetParameter(int k) const { return fPar[k]; }
+  double GetError(int k) const { return std::sqrt(std::max(fCov[(size_t)k * fPar.size() + k], 0.0)); }
+  double GetCovariance(int i, int j) const { return fCov[(size_t)i * fPar.size() + j]; }
+  const std::string& GetParameterName(int k) const { return fNames[k]; }
+
+  /*ur of a sample of mass fraction Fm at temperature T (K) in B_ext (mT), and its error*/
+  double Eval(double Fm, double T, double B_ext) const;
+  double EvalError(double Fm, double T, double B_ext) const;
+
+  /*Parameters, errors and the nuisance pulls*/
+  void WriteResults(const char* f_out) const;
+
+ private:
+  struct Point { double I, B_in, sig; };
+  struct FitSample
+  {
+    std::string name;
+    double Fm, T;
+    int calib, geom;                 // nuisance groups
+    std::vector<double> features;    // p = sum par * features
+    std::vector<Point> points;
+  };
+  /*Constraint of a nuisance group: (value - mean) whitened by L^-1*/
+  struct Constraint
+  {
+    std::string name;
+    int first, n;                    // parameters first..first+n-1
+    double mean[2];
+    double Linv[2][2];
+  };
+  /*Per sample block of the normal equations*/
+  struct Block
+  {
+    double chi2;
+    std::vector<double> g, H;
+  };
+
+  /*
+   * Worker threads started once per fit. Each
+   * Accumulate hands them a new generation of
+   * per sample jobs and waits until all are idle.
+   */
+  struct Workers
+  {
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable wake, idle;
+    long generation;
+    int busy;
+    bool stop;
+    const std::vector<double>* par;
+    std::vector<Block>* blocks;
+    std::vector<double>* chi2;
+    std::atomic<size_t> next;
+  };
+
+  void Features(double Fm, double T, std::vector<double>& f) const;
+  void Setup();
+  double SampleChi2(const FitSample& s, const std::vector<double>& par, Block* block) const;
+  void StartWorkers(Workers* w, int nthreads) const;
+  void StopWorkers(Workers* w) const;
+  void Work(Workers* w) const;
+  double Accumulate(const std::vector<double>& par, std::vector<double>* g, std::vector<double>* H, Workers* w) const;
+  static bool Cholesky(std::vector<double>& A, int n);
+  static void CholeskySolve(const std::vector<double>& L, int n, std::vector<double>& b);
+
+  int    fFmOrder;
+  double fFmRef, fTCold, fB_min;
+  int    fNGlobal, fNFmTerms, fNColdTerms;
+  double fChi2;
+  int    fNPoints;
+
+  std::vector<SampleResult> fInput;
+  std::vector<FitSample>   fSamples;
+  std::vector<Constraint>  fConstraints;
+  std::vector<double>      fPar, fCov;
+  std::vector<std::string> fNames;
+};
+
+inline void GlobalFit::AddSample(const SampleResult& r)
+{
+  if (r.ok) fInput.push_back(r);
+}
+
+/*Powers of dFm, then the same powers times the cold flag*/
+inline void GlobalFit::Features(double Fm, double T, std::vector<double>& f) const
+{
+  f.assign(fNFmTerms + fNColdTerms, 0.0);
+  const double dFm = Fm - fFmRef;
+  double x = 1;
+  for (int k = 0; k < fNFmTerms; k++, x *= dFm) f[k] = x;
+  x = 1;
+  const double cold = T < fTCold ? 1.0 : 0.0;
+  for (int k = 0; k < fNColdTerms; k++, x *= dFm) f[fNFmTerms + k] = cold * x;
+}
+
+/*
+ * Choose the shared terms the samples can
+ * constrain, set up the nuisance groups and take
+ * the starting values from the per-sample fits.
+ */
+inline void GlobalFit::Setup()
+{
+  std::vector<double> fm_all, fm_cold;
+  bool any_room = false;
+  for (size_t k = 0; k < fInput.size(); k++)
+    {
+      const SampleResult& r = fInput[k];
+      if (std::find(fm_all.begin(), fm_all.end(), r.sample.Fm) == fm_all.end()) fm_all.push_back(r.sample.Fm);
+      if (r.sample.T >= fTCold) any_room = true;
+      else if (std::find(fm_cold.begin(), fm_cold.end(), r.sample.Fm) == fm_cold.end()) fm_cold.push_back(r.sample.Fm);
+    }
+  fNFmTerms = std::min(fFmOrder + 1, (int)fm_all.size());
+  /*Without room scans the cold terms cannot be told apart from the others*/
+  fNColdTerms = any_room ? std::min(fFmOrder + 1, (int)fm_cold.size()) : 0;
+  const int nf = fNFmTerms + fNColdTerms;
+  fNGlobal = 2 * nf;
+
+  fNames.clear();
+  for (int p = 0; p < 2; p++)
+    for (int k = 0; k < nf; k++)
+      {
+	std::ostringstream name;
+	name << "p" << p << (k < fNFmTerms ? "" : "_cold");
+	const int power = k < fNFmTerms ? k : k - fNFmTerms;
+	if (power == 1) name << "*dFm";
+	else if (power > 1) name << "*dFm^" << power;
+	fNames.push_back(name.str());
+      }
+
+  /*Nuisance groups, one per calibration file and per diameter pair*/
+  fPar.assign(fNGlobal, 0.0);
+  fConstraints.clear();
+  fSamples.clear();
+  fNPoints = 0;
+  std::map<std::string, int> calib_index, geom_index;
+  double sum_p0 = 0, sum_p1 = 0;
+  for (size_t k = 0; k < fInput.size(); k++)
+    {
+      const SampleResult& r = fInput[k];
+      FitSample s;
+      s.name = r.sample.name;
+      s.Fm = r.sample.Fm;
+      s.T = r.sample.T;
+      Features(s.Fm, s.T, s.features);
+
+      if (!calib_index.count(r.sample.calib))
+	{
+	  Constraint c;
+	  c.name = r.sample.calib;
+	  c.first = (int)fPar.size();
+	  c.n = 2;
+	  c.mean[0] = r.calib.GetIntercept();
+	  c.mean[1] = r.calib.GetSlope();
+	  double v00, v01, v11;
+	  r.calib.GetCovariance(v00, v01, v11);
+	  /*A perfect or two point calibration still gets a finite width*/
+	  v00 = std::max(v00, 1e-12 + 1e-12 * c.mean[0] * c.mean[0]);
+	  v11 = std::max(v11, 1e-12 + 1e-12 * c.mean[1] * c.mean[1]);
+	  const double l00 = std::sqrt(v00), l10 = v01 / l00, l11 = std::sqrt(std::max(v11 - l10 * l10, 1e-6 * v11));
+	  c.Linv[0][0] = 1 / l00;  c.Linv[0][1] = 0;
+	  c.Linv[1][0] = -l10 / (l00 * l11);  c.Linv[1][1] = 1 / l11;
+	  calib_index[c.name] = (int)fConstraints.size();
+	  fConstraints.push_back(c);
+	  fPar.push_back(c.mean[0]);
+	  fPar.push_back(c.mean[1]);
+	  fNames.push_back("c0 " + c.name);
+	  fNames.push_back("c1 " + c.name);
+	}
+      s.calib = fConstraints[calib_index[r.sample.calib]].first;
+
+      const std::string geom_key = r.sample.di + " " + r.sample.dout;
+      if (!geom_index.count(geom_key))
+	{
+	  Constraint c;
+	  c.name = geom_key;
+	  c.first = (int)fPar.size();
+	  c.n = 1;
+	  c.mean[0] = r.geometry.R;
+	  c.Linv[0][0] = 1 / std::max(r.geometry.R_sig, 1e-6 * r.geometry.R);
+	  geom_index[geom_key] = (int)fConstraints.size();
+	  fConstraints.push_back(c);
+	  fPar.push_back(c.mean[0]);
+	  fNames.push_back("R " + geom_key);
+	}
+      s.geom = fConstraints[geom_index[geom_key]].first;
+
+      /*Points with a physical inversion; the error is the probe resolution on B_in and B_ext*/
+      const double slope = r.calib.GetSlope(), intercept = r.calib.GetIntercept();
+      for (size_t i = 0; i < r.ur.size(); i++)
+	{
+	  if (!(r.ur[i] == r.ur[i]) || r.B_ext[i] < fB_min || slope == 0) continue;
+	  Point p;
+	  p.I = (r.B_ext[i] - intercept) / slope;
+	  p.B_in = r.B_in[i];
+	  const double t = r.B_in[i] / r.B_ext[i];
+	  p.sig = std::sqrt(r.sig_B_in[i] * r.sig_B_in[i] + t * t * r.sig_B_ext[i] * r.sig_B_ext[i]);
+	  s.points.push_back(p);
+	}
+      fNPoints += (int)s.points.size();
+
+      sum_p0 += r.p0;
+      sum_p1 += r.p1;
+      fSamples.push_back(s);
+    }
+  /*Start from the mean of the single sample fits, with no Fm or LN2 dependence*/
+  if (!fSamples.empty() && nf > 0)
+    {
+      fPar[0] = sum_p0 / fSamples.size();
+      fPar[nf] = sum_p1 / fSamples.size();
+    }
+}
+
+/*
+ * chi2 of one sample's points; with block given,
+ * also its J^T r and J^T J over the local
+ * parameters (shared ones, then c0, c1, R).
+ */
+inline double GlobalFit::SampleChi2(const FitSample& s, const std::vector<double>& par, Block* block) const
+{
+  const int nf = fNFmTerms + fNColdTerms, nl = fNGlobal + 3;
+  double p0 = 0, p1 = 0;
+  for (int j = 0; j < nf; j++)
+    {
+      p0 += par[j] * s.features[j];
+      p1 += par[nf + j] * s.features[j];
+    }
+  const double c0 = par[s.calib], c1 = par[s.calib + 1], R = par[s.geom], q = R * R;
+  if (block)
+    {
+      block->g.assign(nl, 0.0);
+      block->H.assign((size_t)nl * nl, 0.0);
+    }
+  std::vector<double> J(nl);
+  double chi2 = 0;
+  for (size_t i = 0; i < s.points.size(); i++)
+    {
+      const Point& p = s.points[i];
+      const double E = c0 + c1 * p.I;
+      const double u = p0 / E + p1;
+      const double D = (u + 1) * (u + 1) - (u - 1) * (u - 1) * q;
+      const double T = 4 * u / D;
+      const double res = (p.B_in - E * T) / p.sig;
+      chi2 += res * res;
+      if (!block) continue;
+
+      /*Derivatives of the prediction E*T*/
+      const double dT_du = 4 / D - 4 * u * (2 * (u + 1) - 2 * (u - 1) * q) / (D * D);
+      const double dT_dR = 4 * u * 2 * (u - 1) * (u - 1) * R / (D * D);
+      const double dP_dE = T - dT_du * p0 / E;
+      const double w = -1 / p.sig;
+      for (int j = 0; j < nf; j++)
+	{
+	  J[j] = w * dT_du * s.features[j];
+	  J[nf + j] = w * E * dT_du * s.features[j];
+	}
+      J[fNGlobal] = w * dP_dE;
+      J[fNGlobal + 1] = w * dP_dE * p.I;
+      J[fNGlobal + 2] = w * E * dT_dR;
+      for (int a = 0; a < nl; a++)
+	{
+	  if (J[a] == 0) continue;
+	  block->g[a] += J[a] * res;
+	  double* row = &block->H[(size_t)a * nl];
+	  for (int b = 0; b <= a; b++) row[b] += J[a] * J[b];
+	}
+    }
+  if (block) block->chi2 = chi2;
+  return chi2;
+}
+
+inline void GlobalFit::StartWorkers(Workers* w, int nthreads) const
+{
+  w->generation = 0;
+  w->busy = 0;
+  w->stop = false;
+  const int nt = std::min<int>(nthreads, std::max<size_t>(fSamples.size(), 1));
+  for (int t = 0; t < nt; t++) w->threads.push_back(std::thread(&GlobalFit::Work, this, w));
+}
+
+inline void GlobalFit::StopWorkers(Workers* w) const
+{
+  {
+    std::lock_guard<std::mutex> lock(w->m);
+    w->stop = true;
+  }
+  w->wake.notify_all();
+  for (size_t t = 0; t < w->threads.size(); t++) w->threads[t].join();
+  w->threads.clear();
+}
+
+/*Worker loop: one pass over the samples per generation*/
+inline void GlobalFit::Work(Workers* w) const
+{
+  long seen = 0;
+  const size_t ns = fSamples.size();
+  std::unique_lock<std::mutex> lock(w->m);
+  while (true)
+    {
+      w->wake.wait(lock, [&]() { return w->stop || w->generation != seen; });
+      if (w->stop) return;
+      seen = w->generation;
+      lock.unlock();
+      for (size_t k = w->next++; k < ns; k = w->next++)
+	(*w->chi2)[k] = SampleChi2(fSamples[k], *w->par, w->blocks->empty() ? 0 : &(*w->blocks)[k]);
+      lock.lock();
+      if (--w->busy == 0) w->idle.notify_one();
+    }
+}
+
+/*
+ * chi2 over all samples plus the constraints. With
+ * g and H given, also the full J^T r and J^T J.
+ */
+inline double GlobalFit::Accumulate(const std::vector<double>& par, std::vector<double>* g, std::vector<double>* H, Workers* w) const
+{
+  const int n = (int)par.size(), nl = fNGlobal + 3;
+  const size_t ns = fSamples.size();
+  std::vector<Block> blocks(g ? ns : 0);
+  std::vector<double> chi2(ns, 0.0);
+  {
+    std::unique_lock<std::mutex> lock(w->m);
+    w->par = &par;
+    w->blocks = &blocks;
+    w->chi2 = &chi2;
+    w->next = 0;
+    w->busy = (int)w->threads.size();
+    w->generation++;
+    w->wake.notify_all();
+    w->idle.wait(lock, [&]() { return w->busy == 0; });
+  }
+
+  double total = 0;
+  if (g)
+    {
+      g->assign(n, 0.0);
+      H->assign((size_t)n * n, 0.0);
+    }
+  std::vector<int> index(nl);
+  for (size_t k = 0; k < ns; k++)
+    {
+      total += chi2[k];
+      if (!g) continue;
+      for (int a = 0; a < fNGlobal; a++) index[a] = a;
+      index[fNGlobal] = fSamples[k].calib;
+      index[fNGlobal + 1] = fSamples[k].calib + 1;
+      index[fNGlobal + 2] = fSamples[k].geom;
+      const Block& b = blocks[k];
+      for (int a = 0; a < nl; a++)
+	{
+	  (*g)[index[a]] += b.g[a];
+	  for (int c = 0; c <= a; c++)
+	    {
+	      const int i = std::max(index[a], index[c]), j = std::min(index[a], index[c]);
+	      (*H)[(size_t)i * n + j] += b.H[(size_t)a * nl + c];
+	    }
+	}
+    }
+
+  /*Constraints r = Linv (x - mean), J = Linv*/
+  for (size_t k = 0; k < fConstraints.size(); k++)
+    {
+      const Constraint& c = fConstraints[k];
+      double res[2] = { 0, 0 };
+      for (int a = 0; a < c.n; a++)
+	for (int b = 0; b <= a; b++) res[a] += c.Linv[a][b] * (par[c.first + b] - c.mean[b]);
+      for (int a = 0; a < c.n; a++)
+	{
+	  total += res[a] * res[a];
+	  if (!g) continue;
+	  for (int b = 0; b <= a; b++)
+	    {
+	      (*g)[c.first + b] += c.Linv[a][b] * res[a];
+	      for (int d = 0; d <= b; d++)
+		(*H)[(size_t)(c.first + b) * n + c.first + d] += c.Linv[a][b] * c.Linv[a][d];
+	    }
+	}
+    }
+  return total;
+}
+
+/*In place lower Cholesky factor of the lower triangle of A; false if not positive definite*/
+inline bool GlobalFit::Cholesky(std::vector<double>& A, int n)
+{
+  for (int j = 0; j < n; j++)
+    {
+      double* Aj = &A[(size_t)j * n];
+      double d = Aj[j];
+      for (int k = 0; k < j; k++) d -= Aj[k] * Aj[k];
+      if (!(d > 0)) return false;
+      d = std::sqrt(d);
+      Aj[j] = d;
+      for (int i = j + 1; i < n; i++)
+	{
+	  double* Ai = &A[(size_t)i * n];
+	  double s = Ai[j];
+	  for (int k = 0; k < j; k++) s -= Ai[k] * Aj[k];
+	  Ai[j] = s / d;
+	}
+    }
+  return true;
+}
+
+inline void GlobalFit::CholeskySolve(const std::vector<double>& L, int n, std::vector<double>& b)
+{
+  for (int i = 0; i < n; i++)
+    {
+      double s = b[i];
+      for (int k = 0; k < i; k++) s -= L[(size_t)i * n + k] * b[k];
+      b[i] = s / L[(size_t)i * n + i];
+    }
+  for (int i = n - 1; i >= 0; i--)
+    {
+      double s = b[i];
+      for (int k = i + 1; k < n; k++) s -= L[(size_t)k * n + i] * b[k];
+      b[i] = s / L[(size_t)i * n + i];
+    }
+}
+
+inline int GlobalFit::Fit(int nthreads, int max_iter)
+{
+  Setup();
+  const int n = (int)fPar.size();
+  if (nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+  if (fSamples.empty() || fNGlobal == 0)
+    {
+      std::cerr << "GlobalFit: no samples to fit" << std::endl;
+      return -1;
+    }
+
+  Workers workers;
+  StartWorkers(&workers, nthreads);
+  std::vector<double> g, H, L, step;
+  double lambda = 1e-3;
+  fChi2 = Accumulate(fPar, &g, &H, &workers);
+  int iter = 0;
+  bool converged = false;
+  for (; iter < max_iter && !converged; iter++)
+    {
+      bool improved = false;
+      for (int attempt = 0; attempt < 20 && !improved; attempt++)
+	{
+	  L = H;
+	  for (int a = 0; a < n; a++) L[(size_t)a * n + a] *= 1 + lambda;
+	  if (!Cholesky(L, n))
+	    {
+	      lambda *= 10;
+	      continue;
+	    }
+	  step.assign(g.begin(), g.end());
+	  for (int a = 0; a < n; a++) step[a] = -step[a];
+	  CholeskySolve(L, n, step);
+	  std::vector<double> trial(fPar);
+	  for (int a = 0; a < n; a++) trial[a] += step[a];
+	  const double chi2 = Accumulate(trial, 0, 0, &workers);
+	  if (chi2 <= fChi2)
+	    {
+	      converged = fChi2 - chi2 < 1e-9 * fChi2 + 1e-12;
+	      fPar = trial;
+	      lambda = std::max(lambda * 0.1, 1e-12);
+	      improved = true;
+	      fChi2 = Accumulate(fPar, &g, &H, &workers);
+	    }
+	  else
+	    {
+	      lambda *= 10;
+	    }
+	}
+      if (!improved) converged = true;
+    }
+  StopWorkers(&workers);
+
+  /*Covariance = (J^T J)^-1, one column at a time*/
+  fCov.assign((size_t)n * n, 0.0);
+  L = H;
+  if (!Cholesky(L, n))
+    {
+      std::cerr << "GlobalFit: J^T J is not positive definite, no covariance" << std::endl;
+      return -1;
+    }
+  std::vector<double> col(n);
+  for (int j = 0; j < n; j++)
+    {
+      std::fill(col.begin(), col.end(), 0.0);
+      col[j] = 1;
+      CholeskySolve(L, n, col);
+      for (int i = 0; i < n; i++) fCov[(size_t)i * n + j] = col[i];
+    }
+  return converged ? iter : -1;
+}
+
+inline double GlobalFit::Eval(double Fm, double T, double B_ext) const
+{
+  std::vector<double> f;
+  Features(Fm, T, f);
+  const int nf = (int)f.size();
+  double u = 0;
+  for (int j = 0; j < nf; j++) u += (fPar[j] / B_ext + fPar[nf + j]) * f[j];
+  return u;
+}
+
+inline double GlobalFit::EvalError(double Fm, double T, double B_ext) const
+{
+  std::vector<double> f;
+  Features(Fm, T, f);
+  const int nf = (int)f.size();
+  std::vector<double> d(2 * nf);
+  for (int j = 0; j < nf; j++)
+    {
+      d[j] = f[j] / B_ext;
+      d[nf + j] = f[j];
+    }
+  double var = 0;
+  for (int a = 0; a < 2 * nf; a++)
+    for (int b = 0; b < 2 * nf; b++) var += d[a] * d[b] * GetCovariance(a, b);
+  return std::sqrt(std::max(var, 0.0));
+}
+
+inline void GlobalFit::WriteResults(const char* f_out) const
+{
+  FILE* out = fopen(f_out, "w");
+  if (!out)
+    {
+      std::cerr << "GlobalFit: cannot write " << f_out << std::endl;
+      return;
+    }
+  fprintf(out, "#chi2 = %.6g, ndf = %d, samples = %d, points = %d, Fm_ref = %g\n",
+	  fChi2, GetNDF(), GetNSamples(), fNPoints, fFmRef);
+  fprintf(out, "#name, value, error, pull\n");
+  for (int k = 0; k < (int)fPar.size(); k++)
+    {
+      /*Pull of a nuisance parameter against its own constraint*/
+      double pull = 0;
+      for (size_t c = 0; c < fConstraints.size(); c++)
+	{
+	  const Constraint& con = fConstraints[c];
+	  if (k < con.first || k >= con.first + con.n) continue;
+	  const int a = k - con.first;
+	  for (int b = 0; b <= a; b++) pull += con.Linv[a][b] * (fPar[con.first + b] - con.mean[b]);
+	}
+      fprintf(out, "%s\t%.9g\t%.9g\t%.4g\n", fNames[k].c_str(), fPar[k], GetError(k), pull);
+    }
+  fclose(out);
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Running Straight Line Fit
+ *
+ * Least squares fit of y = p0 + p1*x kept
+ * as running sums, used for the Helmholtz
+ * coil calibration B(I) and the ur vs
+ * 1/B_ext fits.
+ * To use in a macro: #include "LinearFit.h"
+ */
+#ifndef LINEARFIT_H
+#define LINEARFIT_H
+
+#include <cmath>
+
+/*
+ * Points are added one at a time and the fit is
+ * available at any moment in O(1). Sums are kept
+ * relative to the first point added so that large
+ * offsets (e.g. currents of several thousand mA)
+ * do not cost precision.
+ *
+ * Points may carry a weight, normally 1/sig^2;
+ * without one they count 1.
+ *
+ * The parameter covariance is scaled by the
+ * residual variance chi2/(n-2), which is what
+ * numpy.polyfit(..., w=1/sig, cov=True) and an
+ * unweighted TGraph::Fit("pol1") report.
+ */
+class LinearFit
+{
+ public:
+  LinearFit() { Reset(); }
+
+  void Reset()
+  {
+    fN = 0;
+    fW = 0;
+    fX0 = fY0 = 0;
+    fSx = fSy = fSxx = fSxy = fSyy = 0;
+  }
+
+  void Add(double x, double y) { Add(x, y, 1.0); }
+
+  /*Points with a weight that is not positive are ignored*/
+  void Add(double x, double y, double w)
+  {
+    if (!(w > 0)) return;
+    if (fN == 0) { fX0 = x; fY0 = y; }
+    const double dx = x - fX0, dy = y - fY0;
+    fN++;
+    fW += w;
+    fSx += w * dx;  fSy += w * dy;
+    fSxx += w * dx * dx;  fSxy += w * dx * dy;  fSyy += w * dy * dy;
+  }
+
+  void Add(int n, const double* x, const double* y)
+  {
+    for (int i = 0; i < n; i++) Add(x[i], y[i]);
+  }
+
+  long GetN() const { return fN; }
+  bool IsValid() const { return fN >= 2 && Det() > 0; }
+
+  double GetSlope() const { return IsValid() ? (fW * fSxy - fSx * fSy) / Det() : 0.0; }
+  double GetIntercept() const
+  {
+    if (!IsValid()) return fN > 0 ? fY0 + fSy / fW : 0.0;
+    const double b = GetSlope();
+    return fY0 + (fSy - b * fSx) / fW - b * fX0;
+  }
+  double Eval(double x) const { return GetIntercept() + GetSlope() * x; }
+
+  /*Weighted sum of squared residuals*/
+  double GetChi2() const
+  {
+    if (!IsValid()) return 0.0;
+    const double b = GetSlope();
+    const double a = (fSy - b * fSx) / fW;   // intercept in shifted frame
+    double chi2 = fSyy - a * fSy - b * fSxy;
+    return chi2 > 0 ? chi2 : 0.0;
+  }
+
+  /*Covariance of (intercept, slope)*/
+  void GetCovariance(double& var_p0, double& cov_p0p1, double& var_p1) const
+  {
+    var_p0 = cov_p0p1 = var_p1 = 0;
+    if (fN < 3 || !IsValid()) return;
+    const double s2 = GetChi2() / (fN - 2);
+    const double det = Det();
+    /*Undo the shift of the x origin: p0 = a' - p1*x0*/
+    const double v_a = s2 * fSxx / det;
+    const double v_b = s2 * fW / det;
+    const double c_ab = -s2 * fSx / det;
+    var_p1 = v_b;
+    cov_p0p1 = c_ab - fX0 * v_b;
+    var_p0 = v_a - 2 * fX0 * c_ab + fX0 * fX0 * v_b;
+  }
+
+ private:
+  double Det() const { return fW * fSxx - fSx * fSx; }
+
+  long   fN;
+  double fW;                        // sum of weights
+  double fX0, fY0;
+  double fSx, fSy, fSxx, fSxy, fSyy;
+};
+
+#endif
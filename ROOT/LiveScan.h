@@ -0,0 +1,207 @@
+/*
+ * Live Ferromagnet Scan Analysis
+ *
+ * To follow a DataFile_*.txt while the DAQ
+ * is still writing it and update the
+ * calibration, the permeability points and
+ * the [0]/x + [1] fit with every new line.
+ * To use in a macro: #include "LiveScan.h"
+ */
+#ifndef LIVESCAN_H
+#define LIVESCAN_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DataFile.h"
+#include "LinearFit.h"
+#include "Permeability.h"
+#include "Segmenter.h"
+
+/*
+ * The TailReader class remembers how far into a
+ * file it has read. Each Poll() reads only the
+ * bytes appended since the last call and parses
+ * the complete lines among them; a partly written
+ * last line is kept until its newline arrives.
+ * If the file shrinks, is replaced (new inode) or
+ * no longer starts with the bytes first read from
+ * it (truncated and rewritten past the old offset
+ * between two polls), reading restarts from the
+ * top and Poll() returns -1 once so the caller can
+ * reset its sums.
+ */
+class TailReader
+{
+ public:
+  TailReader(const char* f_data, int ncol)
+    : fName(f_data), fNCol(ncol), fOffset(0), fInode(0), fNSkipped(0) {}
+
+  /*Append new rows (ncol values each) to rows; returns rows added or -1 on restart*/
+  int Poll(std::vector<double>& rows)
+  {
+    int fd = open(fName.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+      {
+	close(fd);
+	return 0;
+      }
+    bool restart = false;
+    if ((fInode != 0 && st.st_ino != fInode) || (off_t)fOffset > st.st_size || !SameHead(fd))
+      {
+	fOffset = 0;
+	fPartial.clear();
+	fHead.clear();
+	restart = true;
+      }
+    fInode = st.st_ino;
+    if ((off_t)fOffset == st.st_size)
+      {
+	close(fd);
+	return restart ? -1 : 0;
+      }
+
+    std::vector<char> buf((size_t)(st.st_size - fOffset));
+    ssize_t got = pread(fd, &buf[0], buf.size(), (off_t)fOffset);
+    close(fd);
+    if (got <= 0) return restart ? -1 : 0;
+    if (fHead.size() < kHead) fHead.append(&buf[0], std::min((size_t)got, kHead - fHead.size()));
+    fOffset += (size_t)got;
+    fPartial.append(&buf[0], (size_t)got);
+
+    int nnew = 0;
+    std::vector<double> row(fNCol);
+    size_t start = 0, eol;
+    while ((eol = fPartial.find('\n', start)) != std::string::npos)
+      {
+	const int status = DataFile::ParseLine(fPartial.data() + start, fPartial.data() + eol, fNCol, &row[0]);
+	if (status > 0)
+	  {
+	    rows.insert(rows.end(), row.begin(), row.end());
+	    nnew++;
+	  }
+	else if (status < 0)
+	  {
+	    fNSkipped++;
+	  }
+	start = eol + 1;
+      }
+    fPartial.erase(0, start);
+    return restart ? -1 : nnew;
+  }
+
+  size_t GetOffset() const { return fOffset; }
+  int GetNSkipped() const { return fNSkipped; }
+
+  /*Bytes at the top of the file that must not change between polls*/
+  static const size_t kHead = 256;
+
+ private:
+  bool SameHead(int fd) const
+  {
+    if (fHead.empty()) return true;
+    std::vector<char> head(fHead.size());
+    return pread(fd, &head[0], head.size(), 0) == (ssize_t)head.size()
+      && fHead.compare(0, std::string::npos, &head[0], head.size()) == 0;
+  }
+
+  std::string fName;
+  int         fNCol;
+  size_t      fOffset;
+  ino_t       fInode;
+  std::string fHead;
+  std::string fPartial;
+  int         fNSkipped;
+};
+
+/*
+ * The LiveUvB class turns scan rows into
+ * permeability points as they arrive. The rows go
+ * through the same PlateauSegmenter as in
+ * SamplePipeline, and a setpoint becomes a point
+ * once the next one starts (or Finish() is called
+ * at the end of the scan), with the errors of
+ * SamplePipeline::Invert. Every point costs O(1):
+ * it is inverted and added to the running sums of
+ * the fit ur = [0]/B_ext + [1], which is a straight
+ * line in 1/B_ext, weighted by 1/sig_ur^2. Once
+ * finished, the points and fit are those of the
+ * offline analysis.
+ */
+class LiveUvB
+{
+ public:
+  LiveUvB(const LinearFit& calib, double R, double R_sig, double offset = 0,
+	  double B_res = 0.0005, double B_eval = 50.0, double I_tol = 0.5)
+    : fCalib(calib), fR(R), fR_sig(R_sig), fOffset(offset), fB_res(B_res), fB_eval(B_eval),
+      fSegments(I_tol) {}
+
+  void Reset()
+  {
+    fSegments.Reset();
+    fFit.Reset();
+    fB_ext.clear();  fUr.clear();  fSigUr.clear();
+  }
+
+  void Add(double t, double I, double B)
+  {
+    fSegments.Add(t, I, B);
+    while (GetN() < fSegments.GetN() - 1) AddPoint(fSegments.GetPlateau(GetN()));
+  }
+
+  /*Close the last setpoint once the scan has ended*/
+  void Finish()
+  {
+    while (GetN() < fSegments.GetN()) AddPoint(fSegments.GetPlateau(GetN()));
+  }
+
+  int GetN() const { return (int)fUr.size(); }
+  const double* GetBext() const { return fB_ext.empty() ? 0 : &fB_ext[0]; }
+  const double* GetUr() const { return fUr.empty() ? 0 : &fUr[0]; }
+  const double* GetSigUr() const { return fSigUr.empty() ? 0 : &fSigUr[0]; }
+
+  bool IsFitValid() const { return fFit.IsValid(); }
+  double GetP0() const { return fFit.GetSlope(); }
+  double GetP1() const { return fFit.GetIntercept(); }
+  double GetUrEval() const { return fFit.Eval(1.0 / fB_eval); }
+
+  /*One line per point: Bext, ur, sig_ur, p0, p1, ur(B_eval)*/
+  void WritePoint(FILE* out, int i) const
+  {
+    fprintf(out, "%.9g\t%.9g\t%.9g\t%.9g\t%.9g\t%.9g\n",
+	    fB_ext[i], fUr[i], fSigUr[i], GetP0(), GetP1(), GetUrEval());
+  }
+
+ private:
+  void AddPoint(const Plateau& p)
+  {
+    const double slope = fCalib.GetSlope();
+    const double B_ext = fCalib.GetIntercept() + slope * p.I.mean;
+    const double B_in = p.B.mean - fOffset;
+    const double sig_B_ext = std::sqrt(std::pow(slope * p.I.GetMeanError(), 2) + fB_res * fB_res);
+    const double sig_B_in = std::sqrt(std::pow(p.B.GetMeanError(), 2) + fB_res * fB_res);
+    double ur, sig_ur, sig_pp, sig_corr;
+    Permeability::Invert(1, &B_ext, &sig_B_ext, &B_in, &sig_B_in, fR, fR_sig, &ur, &sig_ur, &sig_pp, &sig_corr);
+    fB_ext.push_back(B_ext);
+    fUr.push_back(ur);
+    fSigUr.push_back(sig_ur);
+    if (ur == ur && B_ext != 0) fFit.Add(1.0 / B_ext, ur, 1.0 / (sig_ur * sig_ur));
+  }
+
+  LinearFit fCalib;
+  double    fR, fR_sig, fOffset, fB_res, fB_eval;
+  PlateauSegmenter fSegments;
+  LinearFit fFit;
+  std::vector<double> fB_ext, fUr, fSigUr;
+};
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Permeability Inversion Kernel
+ *
+ * To invert the shielding ratio B_in/B_ext
+ * of an infinite cylindrical shell with
+ * radius ratio R = r_inner/r_outer into the
+ * relative permeability of the ferromagnet,
+ * for whole columns of a scan at once.
+ * To use in a macro: #include "Permeability.h"
+ */
+#ifndef PERMEABILITY_H
+#define PERMEABILITY_H
+
+#include <cmath>
+
+/*
+ * With b = B_in/B_ext and q = R^2 the closed form is
+ *
+ *   ur = (b(q+1) - 2 - 2 sqrt((bq-1)(b-1))) / (b(q-1))
+ *
+ * The uncertainties are propagated to first order
+ * through the analytic derivatives:
+ *   sig_ur_pp   from B_in and B_ext (point to point)
+ *   sig_ur_corr from R only (geometry, correlated
+ *               between all points of a scan)
+ *   sig_ur      both added in quadrature
+ * which is the same split as the uncertainties
+ * package gives in analyze_fm_permeability.py.
+ *
+ * Where (bq-1)(b-1) < 0 there is no physical
+ * solution. The square root of the negative
+ * argument is NaN and propagates into every output
+ * column of that point, so the loop body needs no
+ * branches and the compiler can vectorize it; build
+ * with -O3 -fno-math-errno so sqrt is not forced to
+ * stay scalar. The columns must not overlap
+ * (__restrict__): with eight pointers the compiler
+ * would otherwise give up on the run time alias
+ * checks and leave the loop scalar.
+ */
+namespace Permeability
+{
+  /*One radius ratio R +/- sig_R for the whole scan*/
+  inline void Invert(int n,
+		     const double* __restrict__ B_ext, const double* __restrict__ sig_B_ext,
+		     const double* __restrict__ B_in, const double* __restrict__ sig_B_in,
+		     double R, double sig_R,
+		     double* __restrict__ ur, double* __restrict__ sig_ur,
+		     double* __restrict__ sig_ur_pp, double* __restrict__ sig_ur_corr)
+  {
+    const double q = R * R;
+    for (int i = 0; i < n; i++)
+      {
+	const double b = B_in[i] / B_ext[i];
+	/*Error of the ratio from both field measurements; finite for B_in = 0*/
+	const double sig_b = std::sqrt(sig_B_in[i] * sig_B_in[i] + b * b * sig_B_ext[i] * sig_B_ext[i])
+	  / std::fabs(B_ext[i]);
+
+	const double S     = std::sqrt((b * q - 1.0) * (b - 1.0));
+	const double N     = b * (q + 1.0) - 2.0 - 2.0 * S;
+	const double D     = b * (q - 1.0);
+	const double u     = N / D;
+
+	/*d(ur)/db and d(ur)/dq from the quotient rule*/
+	const double dN_db = (q + 1.0) - (2.0 * b * q - q - 1.0) / S;
+	const double dN_dq = b - (b * b - b) / S;
+	const double du_db = (dN_db - u * (q - 1.0)) / D;
+	const double du_dq = (dN_dq - u * b) / D;
+
+	const double pp   = std::fabs(du_db) * sig_b;
+	const double corr = std::fabs(2.0 * R * du_dq) * sig_R;
+
+	ur[i]          = u;
+	sig_ur_pp[i]   = pp;
+	sig_ur_corr[i] = corr;
+	sig_ur[i]      = std::sqrt(pp * pp + corr * corr);
+      }
+  }
+
+  /*Permeability only, no uncertainties*/
+  inline double Value(double B_ext, double B_in, double R)
+  {
+    const double q = R * R;
+    const double b = B_in / B_ext;
+    return (b * (q + 1.0) - 2.0 - 2.0 * std::sqrt((b * q - 1.0) * (b - 1.0))) / (b * (q - 1.0));
+  }
+
+  /*Permeability only, for a whole column*/
+  inline void Values(int n, const double* __restrict__ B_ext, const double* __restrict__ B_in, double R,
+		     double* __restrict__ ur)
+  {
+    for (int i = 0; i < n; i++) ur[i] = Value(B_ext[i], B_in[i], R);
+  }
+
+  /*Permeability of an ideal cloak, where B_in = B_ext*/
+  inline double Cloak(double R)
+  {
+    return (1.0 + R * R) / (1.0 - R * R);
+  }
+}
+
+#endif
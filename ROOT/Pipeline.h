@@ -0,0 +1,439 @@
+/*
+ * Multi-Sample Permeability Pipeline
+ *
+ * To run the calibration, geometry and
+ * permeability analysis for every sample
+ * listed in a manifest file on a pool of
+ * threads, computing each calibration fit
+ * and diameter average only once.
+ * To use in a macro: #include "Pipeline.h"
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DataFile.h"
+#include "LinearFit.h"
+#include "Permeability.h"
+#include "Segmenter.h"
+
+/*
+ * One line of a manifest:
+ *
+ *   # name   Fm     offset  calibration  scan  di  do  [T]
+ *   fm602    0.602  0.0     calib.txt    ...
+ *
+ * Columns are separated by white space and lines
+ * starting with '#' are skipped, so a sample can
+ * be switched off by commenting it out. Relative
+ * paths are taken relative to the manifest file.
+ * The offset (mT) is subtracted from the field
+ * measured inside the ferromagnet. T is the sample
+ * temperature in K (room, 295 K, if left off); the
+ * global fit uses it to tell LN2 scans apart.
+ */
+struct Sample
+{
+  std::string name;
+  double      Fm;
+  double      offset;
+  std::string calib;
+  std::string scan;
+  std::string di;
+  std::string dout;
+  double      T;
+};
+
+/*Radius ratio r_inner/r_outer from the measured diameters*/
+struct Geometry
+{
+  double R;
+  double R_sig;
+};
+
+/*Mean of a column of diameters and the error on that mean*/
+struct DiameterStats
+{
+  double mean;
+  double sig;
+};
+
+/*
+ * Everything the pipeline produces for one sample:
+ * the calibration, the inverted scan in the same
+ * columns as the Python results files (one entry
+ * per current setpoint, with the number of rows it
+ * averages and its ramp direction), and the fit
+ * ur = [0]/B_ext + [1] evaluated at B_eval.
+ */
+struct SampleResult
+{
+  Sample    sample;
+  bool      ok;
+  LinearFit calib;
+  Geometry  geometry;
+  std::vector<double> B_ext, sig_B_ext, B_in, sig_B_in;
+  std::vector<double> ur, sig_ur, sig_ur_pp, sig_ur_corr;
+  std::vector<long> count;
+  std::vector<int>  direction;
+  double p0, p1, cov00, cov01, cov11;
+  double ur_eval, sig_ur_eval;
+};
+
+/*
+ * Results of an expensive computation keyed by the
+ * content hash of its input file. The first thread
+ * to ask computes the value; any other thread
+ * asking for the same key meanwhile waits for it.
+ * If the computation throws, the waiting threads
+ * get the exception and the key is dropped so a
+ * later call tries again.
+ */
+template <class T>
+class ContentCache
+{
+ public:
+  template <class F>
+  T Get(uint64_t key, F compute)
+  {
+    std::unique_lock<std::mutex> lock(fMutex);
+    typename std::map<uint64_t, std::shared_future<T> >::iterator it = fEntries.find(key);
+    if (it != fEntries.end())
+      {
+	std::shared_future<T> value = it->second;
+	lock.unlock();
+	return value.get();
+      }
+    std::promise<T> promise;
+    fEntries[key] = promise.get_future().share();
+    lock.unlock();
+    try
+      {
+	T value = compute();
+	promise.set_value(value);
+	return value;
+      }
+    catch (...)
+      {
+	promise.set_exception(std::current_exception());
+	lock.lock();
+	fEntries.erase(key);
+	throw;
+      }
+  }
+
+  size_t GetSize()
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fEntries.size();
+  }
+
+ private:
+  std::mutex fMutex;
+  std::map<uint64_t, std::shared_future<T> > fEntries;
+};
+
+class SamplePipeline
+{
+ public:
+  SamplePipeline() : fB_res(0.0005), fB_eval(50.0), fI_tol(0.5) {}
+
+  /*Field resolution of the Hall probe, mT*/
+  void SetFieldResolution(double B_res) { fB_res = B_res; }
+  /*Rows whose current is within I_tol of each other form one setpoint*/
+  void SetCurrentTolerance(double I_tol) { fI_tol = I_tol; }
+  /*External field at which each sample's fit is quoted, mT*/
+  void SetEvalField(double B_eval) { fB_eval = B_eval; }
+
+  static std::vector<Sample> ReadManifest(const char* f_manifest);
+  static uint64_t HashFile(const char* f_data);
+
+  LinearFit Calibration(const std::string& f_calib);
+  DiameterStats Diameters(const std::string& f_diam);
+  Geometry GetGeometry(const std::string& f_inner, const std::string& f_outer);
+  /*The same without the cache, for a one off read*/
+  static DiameterStats ReadDiameters(const std::string& f_diam);
+  static Geometry MakeGeometry(const DiameterStats& in, const DiameterStats& out);
+
+  /*
+   * Average the rows of a scan per setpoint and
+   * invert them into the point columns of r, with
+   * B_ext = calib_p0 + calib_p1*I and B_in = |B| -
+   * offset. branch = +1 (-1) keeps only the up
+   * (down) ramp, 0 keeps both.
+   */
+  void Invert(int nrows, const double* t, const double* I, const double* B,
+	      double calib_p0, double calib_p1, const Geometry& g, double offset,
+	      SampleResult& r, int branch = 0) const;
+  SampleResult Process(const Sample& sample);
+  /*Process all samples on nthreads threads (0 = all cores)*/
+  std::vector<SampleResult> Run(const std::vector<Sample>& samples, int nthreads = 0);
+
+  static void WriteResults(const char* f_out, const SampleResult& r);
+  void WriteSummary(const char* f_out, const std::vector<SampleResult>& results) const;
+
+  size_t GetNCalibrations() { return fCalib.GetSize(); }
+  size_t GetNDiameterFiles() { return fDiam.GetSize(); }
+
+ private:
+  double fB_res;
+  double fB_eval;
+  double fI_tol;
+  ContentCache<LinearFit>     fCalib;
+  ContentCache<DiameterStats> fDiam;
+};
+
+inline std::vector<Sample> SamplePipeline::ReadManifest(const char* f_manifest)
+{
+  std::vector<Sample> samples;
+  std::ifstream in(f_manifest);
+  if (!in)
+    {
+      std::cerr << "SamplePipeline: cannot open manifest " << f_manifest << std::endl;
+      return samples;
+    }
+  std::string dir(f_manifest);
+  size_t slash = dir.rfind('/');
+  dir = slash == std::string::npos ? std::string() : dir.substr(0, slash + 1);
+
+  std::string line;
+  int nline = 0;
+  while (std::getline(in, line))
+    {
+      nline++;
+      size_t first = line.find_first_not_of(" \t\r");
+      if (first == std::string::npos || line[first] == '#') continue;
+      std::istringstream fields(line);
+      Sample s;
+      if (!(fields >> s.name >> s.Fm >> s.offset >> s.calib >> s.scan >> s.di >> s.dout))
+	{
+	  std::cerr << "SamplePipeline: bad manifest line " << nline << " in " << f_manifest << std::endl;
+	  continue;
+	}
+      if (!(fields >> s.T)) s.T = 295.0;
+      std::string* paths[] = { &s.calib, &s.scan, &s.di, &s.dout };
+      for (int k = 0; k < 4; k++)
+	if ((*paths[k])[0] != '/') *paths[k] = dir + *paths[k];
+      samples.push_back(s);
+    }
+  return samples;
+}
+
+/*
+ * 64 bit FNV-1a of the file contents, 0 if it
+ * cannot be read. Files that cannot be read are
+ * not cached, so they never share a key.
+ */
+inline uint64_t SamplePipeline::HashFile(const char* f_data)
+{
+  uint64_t h = 14695981039346656037ULL;
+  int fd = open(f_data, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      return 0;
+    }
+  size_t size = (size_t)st.st_size;
+  if (size > 0)
+    {
+      void* map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+	{
+	  close(fd);
+	  return 0;
+	}
+      const unsigned char* p = (const unsigned char*)map;
+      for (size_t i = 0; i < size; i++)
+	{
+	  h ^= p[i];
+	  h *= 1099511628211ULL;
+	}
+      munmap(map, size);
+    }
+  close(fd);
+  return h;
+}
+
+inline LinearFit SamplePipeline::Calibration(const std::string& f_calib)
+{
+  auto compute = [&f_calib]()
+    {
+      DataFile Calib(f_calib.c_str(), "t/D:I:B");
+      const double* B = Calib.GetColumn("B");
+      LinearFit fit;
+      for (int i = 0; i < Calib.GetN(); i++) fit.Add(Calib.GetColumn("I")[i], std::fabs(B[i]));
+      return fit;
+    };
+  const uint64_t key = HashFile(f_calib.c_str());
+  return key ? fCalib.Get(key, compute) : compute();
+}
+
+inline DiameterStats SamplePipeline::ReadDiameters(const std::string& f_diam)
+{
+  DataFile Diam(f_diam.c_str(), "d/D");
+  const int n = Diam.GetN();
+  const double* d = Diam.GetColumn(0);
+  DiameterStats s = { 0.0, 0.0 };
+  if (n == 0) return s;
+  for (int i = 0; i < n; i++) s.mean += d[i];
+  s.mean /= n;
+  double var = 0;
+  for (int i = 0; i < n; i++) var += (d[i] - s.mean) * (d[i] - s.mean);
+  /*Same as TH1::GetMeanError: RMS/sqrt(N)*/
+  s.sig = std::sqrt(var / n) / std::sqrt((double)n);
+  return s;
+}
+
+inline DiameterStats SamplePipeline::Diameters(const std::string& f_diam)
+{
+  auto compute = [&f_diam]() { return ReadDiameters(f_diam); };
+  const uint64_t key = HashFile(f_diam.c_str());
+  return key ? fDiam.Get(key, compute) : compute();
+}
+
+inline Geometry SamplePipeline::MakeGeometry(const DiameterStats& in, const DiameterStats& out)
+{
+  Geometry g;
+  g.R = in.mean / out.mean;
+  g.R_sig = g.R * std::sqrt(std::pow(in.sig / in.mean, 2) + std::pow(out.sig / out.mean, 2));
+  return g;
+}
+
+inline Geometry SamplePipeline::GetGeometry(const std::string& f_inner, const std::string& f_outer)
+{
+  return MakeGeometry(Diameters(f_inner), Diameters(f_outer));
+}
+
+inline void SamplePipeline::Invert(int nrows, const double* t, const double* I, const double* B,
+				   double calib_p0, double calib_p1, const Geometry& g, double offset,
+				   SampleResult& r, int branch) const
+{
+  /*
+   * One point per setpoint. The errors are the
+   * spread of the rows around their mean, added in
+   * quadrature to the probe resolution, so a single
+   * row keeps the resolution as before.
+   */
+  PlateauSegmenter segments(fI_tol);
+  segments.Add(nrows, t, I, B);
+  r.B_ext.clear();  r.B_in.clear();  r.sig_B_ext.clear();  r.sig_B_in.clear();
+  r.count.clear();  r.direction.clear();
+  for (int k = 0; k < segments.GetN(); k++)
+    {
+      const Plateau& p = segments.GetPlateau(k);
+      if (branch != 0 && p.direction != branch) continue;
+      r.B_ext.push_back(calib_p0 + calib_p1 * p.I.mean);
+      r.B_in.push_back(p.B.mean - offset);
+      r.sig_B_ext.push_back(std::sqrt(std::pow(calib_p1 * p.I.GetMeanError(), 2) + fB_res * fB_res));
+      r.sig_B_in.push_back(std::sqrt(std::pow(p.B.GetMeanError(), 2) + fB_res * fB_res));
+      r.count.push_back(p.GetCount());
+      r.direction.push_back(p.direction);
+    }
+  const int n = r.B_ext.size();
+  r.ur.resize(n);  r.sig_ur.resize(n);  r.sig_ur_pp.resize(n);  r.sig_ur_corr.resize(n);
+  if (n == 0) return;
+  Permeability::Invert(n, &r.B_ext[0], &r.sig_B_ext[0], &r.B_in[0], &r.sig_B_in[0], g.R, g.R_sig,
+		       &r.ur[0], &r.sig_ur[0], &r.sig_ur_pp[0], &r.sig_ur_corr[0]);
+}
+
+inline SampleResult SamplePipeline::Process(const Sample& sample)
+{
+  SampleResult r;
+  r.sample = sample;
+  r.ok = false;
+  r.p0 = r.p1 = r.cov00 = r.cov01 = r.cov11 = 0;
+  r.ur_eval = r.sig_ur_eval = 0;
+  r.calib = Calibration(sample.calib);
+  r.geometry = GetGeometry(sample.di, sample.dout);
+
+  DataFile Scan(sample.scan.c_str(), "t/D:I:B");
+  int n = Scan.GetN();
+  if (n == 0 || !r.calib.IsValid())
+    {
+      std::cerr << "SamplePipeline: nothing to analyse for " << sample.name << std::endl;
+      return r;
+    }
+  Invert(n, Scan.GetColumn("t"), Scan.GetColumn("I"), Scan.GetColumn("B"),
+	 r.calib.GetIntercept(), r.calib.GetSlope(), r.geometry, sample.offset, r);
+  n = r.ur.size();
+
+  /*ur = [0]/B_ext + [1] is a straight line in 1/B_ext, each point weighted by 1/sig_ur^2*/
+  LinearFit fit;
+  for (int i = 0; i < n; i++)
+    if (r.ur[i] == r.ur[i] && r.B_ext[i] != 0) fit.Add(1.0 / r.B_ext[i], r.ur[i], 1.0 / (r.sig_ur[i] * r.sig_ur[i]));
+  if (!fit.IsValid()) return r;
+  r.p0 = fit.GetSlope();
+  r.p1 = fit.GetIntercept();
+  fit.GetCovariance(r.cov11, r.cov01, r.cov00);
+  const double x = 1.0 / fB_eval;
+  r.ur_eval = r.p0 * x + r.p1;
+  r.sig_ur_eval = std::sqrt(std::max(x * x * r.cov00 + 2 * x * r.cov01 + r.cov11, 0.0));
+  r.ok = true;
+  return r;
+}
+
+inline std::vector<SampleResult> SamplePipeline::Run(const std::vector<Sample>& samples, int nthreads)
+{
+  std::vector<SampleResult> results(samples.size());
+  if (nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+  nthreads = std::min<int>(nthreads, std::max<size_t>(samples.size(), 1));
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < nthreads; t++)
+    workers.push_back(std::thread([this, &samples, &results, &next]()
+      {
+	for (size_t i = next++; i < samples.size(); i = next++) results[i] = Process(samples[i]);
+      }));
+  for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+  return results;
+}
+
+inline void SamplePipeline::WriteResults(const char* f_out, const SampleResult& r)
+{
+  std::ofstream out(f_out);
+  out << "#Bext, sig_Bext, Bi, sig_Bi, ur, sig_ur, sig_ur_pp, sig_ur_corr" << std::endl;
+  out.precision(12);
+  for (size_t i = 0; i < r.ur.size(); i++)
+    out << r.B_ext[i] << "\t" << r.sig_B_ext[i] << "\t" << r.B_in[i] << "\t" << r.sig_B_in[i] << "\t"
+	<< r.ur[i] << "\t" << r.sig_ur[i] << "\t" << r.sig_ur_pp[i] << "\t" << r.sig_ur_corr[i] << "\n";
+}
+
+/*One line per sample: the ur vs Fm points of g_uvFm*/
+inline void SamplePipeline::WriteSummary(const char* f_out, const std::vector<SampleResult>& results) const
+{
+  std::ofstream out(f_out);
+  out << "#name, Fm, R, R_sig, p0, p1, ur(" << fB_eval << " mT), sig_ur" << std::endl;
+  out.precision(12);
+  for (size_t i = 0; i < results.size(); i++)
+    {
+      const SampleResult& r = results[i];
+      if (!r.ok) continue;
+      out << r.sample.name << "\t" << r.sample.Fm << "\t" << r.geometry.R << "\t" << r.geometry.R_sig << "\t"
+	  << r.p0 << "\t" << r.p1 << "\t" << r.ur_eval << "\t" << r.sig_ur_eval << "\n";
+    }
+}
+
+#endif
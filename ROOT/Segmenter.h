@@ -0,0 +1,164 @@
+/*
+ * Setpoint Plateau Segmentation
+ *
+ * To reduce a t/I/B scan, row by row, to one
+ * summary per current setpoint (mean,
+ * variance and count of I and B) and to
+ * label each setpoint as on the up or the
+ * down ramp, so that hysteresis branches can
+ * be analysed separately.
+ * To use in a macro: #include "Segmenter.h"
+ */
+#ifndef SEGMENTER_H
+#define SEGMENTER_H
+
+#include <cmath>
+#include <vector>
+
+/*
+ * Running mean and variance (Welford), stable for
+ * long plateaus of nearly equal values.
+ */
+struct RunningStats
+{
+  long   n;
+  double mean;
+  double m2;
+
+  void Reset() { n = 0; mean = 0; m2 = 0; }
+  void Add(double x)
+  {
+    n++;
+    const double d = x - mean;
+    mean += d / n;
+    m2 += d * (x - mean);
+  }
+  /*Sample variance, 0 for a single value*/
+  double GetVariance() const { return n > 1 ? m2 / (n - 1) : 0.0; }
+  /*Error on the mean*/
+  double GetMeanError() const { return n > 1 ? std::sqrt(m2 / (n - 1) / n) : 0.0; }
+};
+
+/*
+ * One setpoint. direction is +1 on the up ramp, -1
+ * on the down ramp; the first setpoint counts as
+ * up. first is the row index of its first row. t
+ * and c_tI give the least squares dI/dt of its rows.
+ */
+struct Plateau
+{
+  long   first;
+  int    direction;
+  double t_first, t_last;
+  RunningStats I, B, t;
+  double c_tI;
+
+  long GetCount() const { return I.n; }
+  void Add(double t_row, double I_row, double B_abs)
+  {
+    const double dt = t_row - t.mean;
+    t.Add(t_row);
+    I.Add(I_row);
+    B.Add(B_abs);
+    c_tI += dt * (I_row - I.mean);
+    t_last = t_row;
+  }
+  double GetSlope() const { return t.m2 > 0 ? c_tI / t.m2 : 0.0; }
+  /*Change of the fitted current from the first to the last row*/
+  double GetDrift() const { return GetSlope() * (t_last - t_first); }
+};
+
+/*
+ * The PlateauSegmenter class takes the rows of a
+ * scan one at a time. A row joins the current
+ * plateau while its current is within I_tol of the
+ * plateau mean (and, if B_tol > 0, its |B| within
+ * B_tol of the mean |B|), and the fitted dI/dt of
+ * the plateau with the row added moves the current
+ * by at most I_tol over its length; otherwise the
+ * plateau is closed and a new one starts. The dI/dt
+ * test keeps a slow ramp, whose every step is below
+ * I_tol, from creeping into one plateau: it is cut
+ * into pieces at most I_tol wide, each labelled with
+ * the sign of its own dI/dt. On a continuous ramp
+ * every row becomes its own plateau, so nothing is
+ * lost; on a stepped or saturated scan each step
+ * becomes one point. Each row costs O(1) and only
+ * the summaries are kept.
+ */
+class PlateauSegmenter
+{
+ public:
+  PlateauSegmenter(double I_tol = 0.5, double B_tol = 0.0)
+    : fI_tol(I_tol), fB_tol(B_tol), fNRows(0), fOpen(false) {}
+
+  void Reset()
+  {
+    fPlateaus.clear();
+    fNRows = 0;
+    fOpen = false;
+  }
+
+  void Add(double t, double I, double B)
+  {
+    const double B_abs = std::fabs(B);
+    if (fOpen)
+      {
+	Plateau& p = fPlateaus.back();
+	if (std::fabs(I - p.I.mean) <= fI_tol && (fB_tol <= 0 || std::fabs(B_abs - p.B.mean) <= fB_tol))
+	  {
+	    Plateau joined = p;
+	    joined.Add(t, I, B_abs);
+	    if (std::fabs(joined.GetDrift()) <= fI_tol)
+	      {
+		p = joined;
+		fNRows++;
+		return;
+	      }
+	  }
+      }
+    Plateau p;
+    p.first = fNRows;
+    p.t_first = t;
+    p.I.Reset();
+    p.B.Reset();
+    p.t.Reset();
+    p.c_tI = 0;
+    p.Add(t, I, B_abs);
+    /*
+     * Direction against the previous setpoint. A step
+     * within the tolerance keeps it, unless the previous
+     * one was a piece of a slow ramp, which gives its own.
+     */
+    p.direction = 1;
+    if (!fPlateaus.empty())
+      {
+	const Plateau& prev = fPlateaus.back();
+	const double step = I - prev.I.mean, drift = prev.GetDrift();
+	if (std::fabs(step) > fI_tol) p.direction = step > 0 ? 1 : -1;
+	else if (std::fabs(drift) > fI_tol / 2) p.direction = drift > 0 ? 1 : -1;
+	else p.direction = prev.direction;
+      }
+    fPlateaus.push_back(p);
+    fOpen = true;
+    fNRows++;
+  }
+
+  void Add(long n, const double* t, const double* I, const double* B)
+  {
+    for (long i = 0; i < n; i++) Add(t ? t[i] : (double)i, I[i], B[i]);
+  }
+
+  int GetN() const { return (int)fPlateaus.size(); }
+  long GetNRows() const { return fNRows; }
+  const Plateau& GetPlateau(int k) const { return fPlateaus[k]; }
+  const std::vector<Plateau>& GetPlateaus() const { return fPlateaus; }
+
+ private:
+  double fI_tol, fB_tol;
+  long   fNRows;
+  bool   fOpen;
+  std::vector<Plateau> fPlateaus;
+};
+
+#endif
@@ -0,0 +1,870 @@
+/*
+ * Finite Ferromagnetic Shell Field Solver
+ *
+ * To compute the field in and around a
+ * ferromagnetic tube of finite length in
+ * a uniform transverse field B0, with a
+ * field dependent permeability, and to fit
+ * the permeability law to measured B vs z
+ * and B vs x maps.
+ * To use in a macro: #include "ShellSolver.h"
+ */
+#ifndef SHELLSOLVER_H
+#define SHELLSOLVER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/*
+ * Permeability law used inside the ferromagnet,
+ *
+ *   ur(h) = mu_sat + a / (h + h0)
+ *
+ * with h = mu0 |H| in mT. For h0 = 0 this is the
+ * [0]/x + [1] form fitted to ur vs B0 in
+ * makePlot_uvB.C; h0 > 0 keeps ur finite at zero
+ * field. A constant ur is a = 0.
+ */
+struct MaterialLaw
+{
+  double mu_sat;
+  double a;
+  double h0;
+
+  double Eval(double h) const { return std::max(mu_sat + a / (h + h0), 1.0); }
+  /*d ur / dh, 0 where ur is held at 1*/
+  double Derivative(double h) const { return mu_sat + a / (h + h0) > 1.0 ? -a / ((h + h0) * (h + h0)) : 0.0; }
+};
+
+/*Dimensions of the tube, in mm; the tube is centred on z = 0*/
+struct ShellGeometry
+{
+  double r_in;
+  double r_out;
+  double length;
+};
+
+/*
+ * The ShellSolver class solves for the magnetic
+ * scalar potential around the tube. The applied
+ * field is along x, perpendicular to the tube axis
+ * (z), so the potential has the form
+ *
+ *   psi(r, phi, z) = u(r, z) cos(phi)
+ *
+ * and only u has to be found on an r-z grid:
+ *
+ *   d/dr(ur r du/dr) + r d/dz(ur du/dz) - ur u / r = 0
+ *
+ * with u = 0 on the axis and u = -B0 r on the far
+ * boundary. For a field dependent ur the cos(phi)
+ * form is exact only in the linear case; here ur
+ * is evaluated at the RMS of |H| around the tube,
+ * which keeps the problem two dimensional.
+ *
+ * The equation is discretised with finite volumes
+ * (symmetric, positive definite). A cell cut by a
+ * surface of the tube gets a separate permeability
+ * for each flux direction: layers crossed by the
+ * flux add as resistances in series (harmonic
+ * mean, logarithmic in r), layers along it in
+ * parallel (arithmetic mean). This keeps the radial
+ * flux through the walls right although r_in and
+ * r_out do not fall on grid lines. It is solved by
+ * conjugate gradients preconditioned with multigrid
+ * V-cycles (red-black Gauss-Seidel, the rows of
+ * each colour shared among SetThreads() threads),
+ * which stays robust for ur of several hundred. A
+ * field dependent ur is handled by Newton steps:
+ * the correction is solved with the differential
+ * permeability (the diagonal of dB/dH) in place of
+ * ur, and ur is then updated from the new
+ * potential. The potential and ur are kept
+ * between calls, so a new solve with slightly
+ * different parameters (inside a fit) starts from
+ * the previous solution and needs only a few
+ * cycles.
+ *
+ * Units: lengths in mm, fields in mT.
+ */
+class ShellSolver
+{
+ public:
+  /*nr and nz are the number of cells; both should be divisible by 2 several times*/
+  ShellSolver(const ShellGeometry& geom, double r_max, double z_max, int nr = 128, int nz = 256)
+    : fGeom(geom), fRMax(r_max), fZMax(z_max), fB0(0), fNThreads(1)
+  {
+    fLaw.mu_sat = 1;  fLaw.a = 0;  fLaw.h0 = 0;
+    int lnr = nr, lnz = nz;
+    while (true)
+      {
+	Level l;
+	l.nr = lnr;  l.nz = lnz;
+	l.hr = r_max / lnr;  l.hz = 2 * z_max / lnz;
+	/*Coarsen only the finer direction when the cells are long and thin*/
+	l.cr = l.hr < l.hz / 1.5 ? 2 : (l.hz < l.hr / 1.5 ? 1 : 2);
+	l.cz = l.hz < l.hr / 1.5 ? 2 : (l.hr < l.hz / 1.5 ? 1 : 2);
+	const size_t nodes = (size_t)(lnr + 1) * (lnz + 1), cells = (size_t)lnr * lnz;
+	l.u.assign(nodes, 0);  l.f.assign(nodes, 0);  l.res.assign(nodes, 0);
+	l.We.assign(nodes, 0);  l.Wn.assign(nodes, 0);  l.D.assign(nodes, 0);
+	l.mur.assign(cells, 1);  l.muz.assign(cells, 1);  l.mup.assign(cells, 1);
+	fLevels.push_back(l);
+	if ((l.cr == 2 && (lnr % 2 || lnr <= 4)) || (l.cz == 2 && (lnz % 2 || lnz <= 4))) break;
+	lnr /= l.cr;  lnz /= l.cz;
+      }
+
+    /*Radial and axial fraction of each fine cell inside the ferromagnet*/
+    Level& l = fLevels[0];
+    fFracR.assign((size_t)l.nr * l.nz, 0);
+    fFracZ.assign((size_t)l.nr * l.nz, 0);
+    fMu.assign((size_t)l.nr * l.nz, 1);
+    fMuDR.assign((size_t)l.nr * l.nz, 1);
+    fMuDZ.assign((size_t)l.nr * l.nz, 1);
+    fMuDP.assign((size_t)l.nr * l.nz, 1);
+    for (int j = 0; j < l.nz; j++)
+      for (int i = 0; i < l.nr; i++)
+	{
+	  const double r0 = i * l.hr, z0 = -z_max + j * l.hz;
+	  fFracR[(size_t)j * l.nr + i] = Overlap(r0, r0 + l.hr, geom.r_in, geom.r_out) / l.hr;
+	  fFracZ[(size_t)j * l.nr + i] = Overlap(z0, z0 + l.hz, -0.5 * geom.length, 0.5 * geom.length) / l.hz;
+	}
+  }
+
+  void SetMaterial(const MaterialLaw& law) { fLaw = law; }
+  const MaterialLaw& GetMaterial() const { return fLaw; }
+  /*Threads for the smoother on the fine levels (0 = all cores); the result does not depend on it*/
+  void SetThreads(int nthreads)
+  {
+    fNThreads = nthreads > 0 ? nthreads : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  /*
+   * Solve for applied field B0 (mT). Returns the
+   * number of V-cycles used, or -1 if the residual
+   * did not drop below tol (relative) in max_cycles.
+   */
+  int Solve(double B0, double tol = 1e-7, int max_cycles = 200);
+
+  /*x component of B (along the applied field) at a point, mT*/
+  double GetBx(double x, double y, double z) const;
+  /*Field on the tube axis*/
+  double GetBAxis(double z) const { return GetBx(0, 0, z); }
+  /*Permeability of the fine cell containing (r, z), averaged over its volume*/
+  double GetMu(double r, double z) const;
+
+  /*
+   * B_in/B0 on the axis of an infinitely long tube
+   * of constant ur with u = -B0 r at r_max, the
+   * limit the solver has to reproduce for a long
+   * tube.
+   */
+  static double LongTubeRatio(double mu, double r_in, double r_out, double r_max);
+
+ private:
+  struct Level
+  {
+    int nr, nz;
+    int cr, cz;                      // coarsening factors to the next level
+    double hr, hz;
+    std::vector<double> u, f, res;
+    std::vector<double> We, Wn, D;   // east/north face weights, diagonal
+    std::vector<double> mur, muz, mup;  // per cell, for r, z and phi flux
+    size_t Id(int i, int j) const { return (size_t)j * (nr + 1) + i; }
+  };
+
+  static double Overlap(double a0, double a1, double b0, double b1)
+  {
+    return std::max(0.0, std::min(a1, b1) - std::max(a0, b0));
+  }
+
+  /*Threads wait here between the colours of a sweep*/
+  struct SpinBarrier
+  {
+    std::atomic<int> count, generation;
+    int n;
+    void Wait()
+    {
+      const int gen = generation.load();
+      if (count.fetch_add(1) + 1 == n)
+	{
+	  count.store(0);
+	  generation.fetch_add(1);
+	}
+      else
+	while (generation.load() == gen) std::this_thread::yield();
+    }
+  };
+  /*Fewer rows per thread than this are smoothed serially*/
+  static const int kNodesPerThread = 8192;
+  /*Largest relative change of ur per cycle at which Newton steps take over*/
+  static constexpr double kNewtonStart = 0.05;
+
+  void SetBoundary();
+  void CellMu(int i, int j, double mu, double& mur, double& muz, double& mup) const;
+  void BuildOperator(Level& l) const;
+  void SmoothRows(Level& l, int j0, int j1, int color) const;
+  void Smooth(Level& l, int sweeps, bool reverse) const;
+  void Residual(Level& l) const;
+  double ResidualNorm(const Level& l) const;
+  void VCycle(int k);
+  double UpdateMu(double damping);
+  void SetOperator(bool differential);
+  int Correct(double reduce, double abs_tol, int max_cycles);
+
+  ShellGeometry fGeom;
+  double fRMax, fZMax, fB0;
+  int fNThreads;
+  MaterialLaw fLaw;
+  std::vector<Level> fLevels;
+  std::vector<double> fFracR, fFracZ;
+  std::vector<double> fMu;         // ur of the ferromagnet in each fine cell
+  std::vector<double> fMuDR, fMuDZ, fMuDP;  // differential ur for the r, z and phi components
+  std::vector<double> fU, fR, fE, fP, fQ;  // conjugate gradient vectors
+};
+
+/*Dirichlet values: u = 0 on the axis, -B0 r far away*/
+inline void ShellSolver::SetBoundary()
+{
+  Level& l = fLevels[0];
+  for (int j = 0; j <= l.nz; j++)
+    {
+      l.u[l.Id(0, j)] = 0;
+      l.u[l.Id(l.nr, j)] = -fB0 * fRMax;
+    }
+  for (int i = 0; i <= l.nr; i++)
+    {
+      l.u[l.Id(i, 0)] = -fB0 * i * l.hr;
+      l.u[l.Id(i, l.nz)] = -fB0 * i * l.hr;
+    }
+}
+
+/*
+ * Permeabilities of fine cell (i, j) for the r, z
+ * and phi flux when the ferromagnet part of it has
+ * ur = mu. The ferromagnet fills a block of the
+ * cell, fFracR wide and fFracZ long.
+ */
+inline void ShellSolver::CellMu(int i, int j, double mu, double& mur, double& muz, double& mup) const
+{
+  const Level& l = fLevels[0];
+  const size_t c = (size_t)j * l.nr + i;
+  const double fr = fFracR[c], fz = fFracZ[c];
+  /*Radial flux crosses the wall: integral of dr/(ur r) over the cell*/
+  const double r0 = i * l.hr, r1 = r0 + l.hr;
+  double hr_mu = mu;
+  if (fr < 1 && r0 > 0)
+    {
+      const double m0 = std::max(r0, fGeom.r_in), m1 = std::min(r1, fGeom.r_out);
+      hr_mu = std::log(r1 / r0) / (std::log(r1 / r0) + (1 / mu - 1) * std::log(m1 / m0));
+    }
+  else if (fr < 1)
+    hr_mu = 1 / (fr / mu + 1 - fr);
+  const double hz_mu = 1 / (fz / mu + 1 - fz);
+  mur = fz * hr_mu + 1 - fz;
+  muz = fr * hz_mu + 1 - fr;
+  mup = 1 + fr * fz * (mu - 1);
+}
+
+inline void ShellSolver::BuildOperator(Level& l) const
+{
+  const double hr = l.hr, hz = l.hz;
+  std::fill(l.We.begin(), l.We.end(), 0.0);
+  std::fill(l.Wn.begin(), l.Wn.end(), 0.0);
+  std::fill(l.D.begin(), l.D.end(), 0.0);
+  for (int j = 0; j <= l.nz; j++)
+    for (int i = 0; i <= l.nr; i++)
+      {
+	const double r = i * hr;
+	/*Face between (i,j) and (i+1,j): cells (i,j-1) and (i,j)*/
+	if (i < l.nr && j > 0 && j < l.nz)
+	  l.We[l.Id(i, j)] = (hz / hr) * (r + 0.5 * hr) * 0.5 * (l.mur[(size_t)(j - 1) * l.nr + i] + l.mur[(size_t)j * l.nr + i]);
+	/*Face between (i,j) and (i,j+1): cells (i-1,j) and (i,j)*/
+	if (j < l.nz && i > 0 && i < l.nr)
+	  l.Wn[l.Id(i, j)] = (hr / hz) * 0.5 * (l.muz[(size_t)j * l.nr + i - 1] * (r - 0.25 * hr)
+						 + l.muz[(size_t)j * l.nr + i] * (r + 0.25 * hr));
+      }
+  for (int j = 1; j < l.nz; j++)
+    for (int i = 1; i < l.nr; i++)
+      {
+	const double r = i * hr, q = 0.25 * hr * hz;
+	/*u/r taken at the node, which is exact for the uniform field u = -B r*/
+	const double mass = q / r * (l.mup[(size_t)(j - 1) * l.nr + i - 1] + l.mup[(size_t)j * l.nr + i - 1]
+				     + l.mup[(size_t)(j - 1) * l.nr + i] + l.mup[(size_t)j * l.nr + i]);
+	const size_t id = l.Id(i, j);
+	l.D[id] = l.We[id] + l.We[id - 1] + l.Wn[id] + l.Wn[id - (l.nr + 1)] + mass;
+      }
+}
+
+/*One colour of Gauss-Seidel on the interior nodes of rows j0 to j1 - 1*/
+inline void ShellSolver::SmoothRows(Level& l, int j0, int j1, int color) const
+{
+  const size_t s = l.nr + 1;
+  for (int j = j0; j < j1; j++)
+    for (int i = 1 + ((j + color) & 1); i < l.nr; i += 2)
+      {
+	const size_t id = l.Id(i, j);
+	l.u[id] = (l.f[id] + l.We[id] * l.u[id + 1] + l.We[id - 1] * l.u[id - 1]
+		   + l.Wn[id] * l.u[id + s] + l.Wn[id - s] * l.u[id - s]) / l.D[id];
+      }
+}
+
+/*
+ * Red-black Gauss-Seidel on the interior nodes. The
+ * nodes of one colour only depend on the other, so
+ * each thread takes a band of rows and the threads
+ * meet between colours; the result is the same as
+ * with one thread.
+ */
+inline void ShellSolver::Smooth(Level& l, int sweeps, bool reverse) const
+{
+  const int nthreads = std::min(fNThreads, std::max(1, (l.nr + 1) * (l.nz - 1) / kNodesPerThread));
+  if (nthreads == 1)
+    {
+      for (int k = 0; k < sweeps; k++)
+	for (int c = 0; c < 2; c++) SmoothRows(l, 1, l.nz, reverse ? 1 - c : c);
+      return;
+    }
+  SpinBarrier barrier;
+  barrier.count = 0;
+  barrier.generation = 0;
+  barrier.n = nthreads;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < nthreads; t++)
+    workers.push_back(std::thread([&, t]()
+      {
+	const int j0 = 1 + (int)((long)(l.nz - 1) * t / nthreads), j1 = 1 + (int)((long)(l.nz - 1) * (t + 1) / nthreads);
+	for (int k = 0; k < sweeps; k++)
+	  for (int c = 0; c < 2; c++)
+	    {
+	      SmoothRows(l, j0, j1, reverse ? 1 - c : c);
+	      barrier.Wait();
+	    }
+      }));
+  for (int t = 0; t < nthreads; t++) workers[t].join();
+}
+
+inline void ShellSolver::Residual(Level& l) const
+{
+  const size_t s = l.nr + 1;
+  std::fill(l.res.begin(), l.res.end(), 0.0);
+  for (int j = 1; j < l.nz; j++)
+    for (int i = 1; i < l.nr; i++)
+      {
+	const size_t id = l.Id(i, j);
+	l.res[id] = l.f[id] - l.D[id] * l.u[id] + l.We[id] * l.u[id + 1] + l.We[id - 1] * l.u[id - 1]
+	  + l.Wn[id] * l.u[id + s] + l.Wn[id - s] * l.u[id - s];
+      }
+}
+
+inline double ShellSolver::ResidualNorm(const Level& l) const
+{
+  double sum = 0;
+  for (size_t k = 0; k < l.res.size(); k++) sum += l.res[k] * l.res[k];
+  return std::sqrt(sum);
+}
+
+inline void ShellSolver::VCycle(int k)
+{
+  Level& l = fLevels[k];
+  if (k + 1 == (int)fLevels.size())
+    {
+      Smooth(l, 25, false);
+      Smooth(l, 25, true);
+      return;
+    }
+  Smooth(l, 2, false);
+  Residual(l);
+
+  /*Restrict with the transpose of bilinear interpolation*/
+  Level& c = fLevels[k + 1];
+  std::fill(c.f.begin(), c.f.end(), 0.0);
+  std::fill(c.u.begin(), c.u.end(), 0.0);
+  for (int J = 1; J < c.nz; J++)
+    for (int I = 1; I < c.nr; I++)
+      {
+	double sum = 0;
+	for (int dj = -1; dj <= 1; dj++)
+	  for (int di = -1; di <= 1; di++)
+	    {
+	      if ((di && l.cr == 1) || (dj && l.cz == 1)) continue;
+	      sum += l.res[l.Id(l.cr * I + di, l.cz * J + dj)] * (di ? 0.5 : 1.0) * (dj ? 0.5 : 1.0);
+	    }
+	c.f[c.Id(I, J)] = sum;
+      }
+  VCycle(k + 1);
+
+  /*Interpolate the coarse correction back*/
+  for (int j = 1; j < l.nz; j++)
+    for (int i = 1; i < l.nr; i++)
+      {
+	const int I = i / l.cr, J = j / l.cz;
+	const bool oi = i % l.cr, oj = j % l.cz;
+	double e = c.u[c.Id(I, J)];
+	if (oi && oj) e = 0.25 * (e + c.u[c.Id(I + 1, J)] + c.u[c.Id(I, J + 1)] + c.u[c.Id(I + 1, J + 1)]);
+	else if (oi) e = 0.5 * (e + c.u[c.Id(I + 1, J)]);
+	else if (oj) e = 0.5 * (e + c.u[c.Id(I, J + 1)]);
+	l.u[l.Id(i, j)] += e;
+      }
+  Smooth(l, 2, true);
+}
+
+/*
+ * Recompute ur in every ferromagnet cell from the
+ * current potential, along with the differential
+ * ur for the Newton step, and build the operator
+ * on all levels. Returns the largest relative
+ * change of ur.
+ */
+inline double ShellSolver::UpdateMu(double damping)
+{
+  Level& l = fLevels[0];
+  double change = 0;
+  for (int j = 0; j < l.nz; j++)
+    for (int i = 0; i < l.nr; i++)
+      {
+	const size_t c = (size_t)j * l.nr + i;
+	if (fFracR[c] * fFracZ[c] == 0) continue;
+	const double u00 = l.u[l.Id(i, j)], u10 = l.u[l.Id(i + 1, j)];
+	const double u01 = l.u[l.Id(i, j + 1)], u11 = l.u[l.Id(i + 1, j + 1)];
+	const double r = (i + 0.5) * l.hr;
+	const double du_dr = 0.5 * (u10 - u00 + u11 - u01) / l.hr;
+	const double du_dz = 0.5 * (u01 - u00 + u11 - u10) / l.hz;
+	const double u_r = 0.25 * (u00 + u10 + u01 + u11) / r;
+	/*
+	 * H in the ferromagnet part of the cell: across a
+	 * wall B is continuous, so H there is the flux of
+	 * the layers in series over ur; along the walls H
+	 * is the cell average.
+	 */
+	const double fr = fFracR[c], fz = fFracZ[c];
+	double mur, muz, mup;
+	CellMu(i, j, fMu[c], mur, muz, mup);
+	const double Hr = du_dr * (mur - 1 + fz) / (fz * fMu[c]);
+	const double Hz = du_dz * (muz - 1 + fr) / (fr * fMu[c]);
+	/*RMS over phi of |H| for psi = u cos(phi)*/
+	const double h = std::sqrt(0.5 * (Hr * Hr + Hz * Hz + u_r * u_r));
+	const double mu = fMu[c] + damping * (fLaw.Eval(h) - fMu[c]);
+	change = std::max(change, std::fabs(mu - fMu[c]) / fMu[c]);
+	fMu[c] = mu;
+	/*dB_k/dH_k = ur + dur/dh H_k^2 / (2 h), which stays above d(ur h)/dh > 0*/
+	const double dmu = h > 0 ? fLaw.Derivative(h) / (2 * h) : 0.0;
+	fMuDR[c] = mu + dmu * Hr * Hr;
+	fMuDZ[c] = mu + dmu * Hz * Hz;
+	fMuDP[c] = mu + dmu * u_r * u_r;
+      }
+  SetOperator(false);
+  return change;
+}
+
+/*
+ * Per direction ur of every cell, from fMu or (for
+ * the Newton correction) the differential ur,
+ * coarsened to all levels, and the operators.
+ */
+inline void ShellSolver::SetOperator(bool differential)
+{
+  Level& l = fLevels[0];
+  for (int j = 0; j < l.nz; j++)
+    for (int i = 0; i < l.nr; i++)
+      {
+	const size_t c = (size_t)j * l.nr + i;
+	if (fFracR[c] * fFracZ[c] == 0) { l.mur[c] = l.muz[c] = l.mup[c] = 1; continue; }
+	if (!differential)
+	  {
+	    CellMu(i, j, fMu[c], l.mur[c], l.muz[c], l.mup[c]);
+	    continue;
+	  }
+	double unused0, unused1;
+	CellMu(i, j, fMuDR[c], l.mur[c], unused0, unused1);
+	CellMu(i, j, fMuDZ[c], unused0, l.muz[c], unused1);
+	CellMu(i, j, fMuDP[c], unused0, unused1, l.mup[c]);
+      }
+  for (size_t k = 1; k < fLevels.size(); k++)
+    {
+      const Level& f = fLevels[k - 1];
+      Level& c = fLevels[k];
+      /*Harmonic along the flux, arithmetic across it, as for the fine cells*/
+      for (int J = 0; J < c.nz; J++)
+	for (int I = 0; I < c.nr; I++)
+	  {
+	    double sum_r = 0, sum_z = 0, sum_p = 0;
+	    for (int dj = 0; dj < f.cz; dj++)
+	      {
+		double inv = 0;
+		for (int di = 0; di < f.cr; di++) inv += 1 / f.mur[(size_t)(f.cz * J + dj) * f.nr + f.cr * I + di];
+		sum_r += f.cr / inv;
+	      }
+	    for (int di = 0; di < f.cr; di++)
+	      {
+		double inv = 0;
+		for (int dj = 0; dj < f.cz; dj++) inv += 1 / f.muz[(size_t)(f.cz * J + dj) * f.nr + f.cr * I + di];
+		sum_z += f.cz / inv;
+	      }
+	    for (int dj = 0; dj < f.cz; dj++)
+	      for (int di = 0; di < f.cr; di++) sum_p += f.mup[(size_t)(f.cz * J + dj) * f.nr + f.cr * I + di];
+	    const size_t id = (size_t)J * c.nr + I;
+	    c.mur[id] = sum_r / f.cz;
+	    c.muz[id] = sum_z / f.cr;
+	    c.mup[id] = sum_p / (f.cr * f.cz);
+	  }
+    }
+  for (size_t k = 0; k < fLevels.size(); k++) BuildOperator(fLevels[k]);
+}
+
+/*
+ * Correction e of the fine level potential from
+ * A e = res, with A the current operator and res
+ * the residual left in l.res, by conjugate
+ * gradients preconditioned with one V-cycle per
+ * iteration (symmetric, since the smoothing after
+ * the coarse correction runs in reverse order).
+ * Stops once |res| has dropped by reduce or below
+ * abs_tol, then u += e. Returns the V-cycles used.
+ */
+inline int ShellSolver::Correct(double reduce, double abs_tol, int max_cycles)
+{
+  Level& l = fLevels[0];
+  const size_t n = l.u.size(), s = l.nr + 1;
+  fU = l.u;
+  fR = l.res;
+  fE.assign(n, 0.0);
+  fP.assign(n, 0.0);
+  fQ.assign(n, 0.0);
+  const double target = std::max(reduce * ResidualNorm(l), abs_tol);
+  double rz = 0;
+  int cycles = 0;
+  while (cycles < max_cycles)
+    {
+      /*z = M r: one V-cycle on the correction, from 0*/
+      l.f = fR;
+      std::fill(l.u.begin(), l.u.end(), 0.0);
+      VCycle(0);
+      cycles++;
+      double rz_new = 0;
+      for (size_t k = 0; k < n; k++) rz_new += fR[k] * l.u[k];
+      const double beta = rz > 0 ? rz_new / rz : 0.0;
+      rz = rz_new;
+      for (size_t k = 0; k < n; k++) fP[k] = l.u[k] + beta * fP[k];
+
+      double pq = 0;
+      for (int j = 1; j < l.nz; j++)
+	for (int i = 1; i < l.nr; i++)
+	  {
+	    const size_t id = l.Id(i, j);
+	    fQ[id] = l.D[id] * fP[id] - l.We[id] * fP[id + 1] - l.We[id - 1] * fP[id - 1]
+	      - l.Wn[id] * fP[id + s] - l.Wn[id - s] * fP[id - s];
+	    pq += fP[id] * fQ[id];
+	  }
+      if (!(pq > 0)) break;
+      const double alpha = rz / pq;
+      double norm = 0;
+      for (size_t k = 0; k < n; k++)
+	{
+	  fE[k] += alpha * fP[k];
+	  fR[k] -= alpha * fQ[k];
+	  norm += fR[k] * fR[k];
+	}
+      if (std::sqrt(norm) < target) break;
+    }
+  for (size_t k = 0; k < n; k++) l.u[k] = fU[k] + fE[k];
+  std::fill(l.f.begin(), l.f.end(), 0.0);
+  return cycles;
+}
+
+inline int ShellSolver::Solve(double B0, double tol, int max_cycles)
+{
+  Level& l = fLevels[0];
+  /*Warm start: rescale the previous potential to the new field*/
+  if (fB0 != 0 && B0 != fB0)
+    for (size_t k = 0; k < l.u.size(); k++) l.u[k] *= B0 / fB0;
+  const bool cold = fB0 == 0;
+  fB0 = B0;
+  SetBoundary();
+  if (cold)
+    for (int j = 1; j < l.nz; j++)
+      for (int i = 1; i < l.nr; i++) l.u[l.Id(i, j)] = -B0 * i * l.hr;
+  std::fill(l.f.begin(), l.f.end(), 0.0);
+
+  /*
+   * A constant ur is linear and solved in one go.
+   * Otherwise each step cuts the residual of the
+   * linearised problem to 0.3: damped fixed point
+   * updates of ur until it changes by less than
+   * kNewtonStart per step, then Newton steps.
+   */
+  double change = UpdateMu(cold ? 1.0 : 0.7);
+  /*Norm of the applied field term, to make tol relative*/
+  const double scale = std::fabs(B0) * fRMax * std::sqrt((double)l.nr * l.nz) + 1e-300;
+  int cycles = 0;
+  Residual(l);
+  while (cycles < max_cycles)
+    {
+      const bool newton = fLaw.a != 0 && change < kNewtonStart;
+      if (newton) SetOperator(true);
+      cycles += Correct(fLaw.a != 0 ? 0.3 : 0.0, 0.1 * tol * scale, max_cycles - cycles);
+      change = UpdateMu(newton ? 1.0 : 0.7);
+      Residual(l);
+      if (ResidualNorm(l) < tol * scale && change < tol) return cycles;
+    }
+  std::cerr << "ShellSolver: no convergence in " << max_cycles << " cycles" << std::endl;
+  return -1;
+}
+
+inline double ShellSolver::GetMu(double r, double z) const
+{
+  const Level& l = fLevels[0];
+  const int i = std::min(std::max((int)(r / l.hr), 0), l.nr - 1);
+  const int j = std::min(std::max((int)((z + fZMax) / l.hz), 0), l.nz - 1);
+  return l.mup[(size_t)j * l.nr + i];
+}
+
+inline double ShellSolver::LongTubeRatio(double mu, double r_in, double r_out, double r_max)
+{
+  /*u = A r + C / r in each region; start from u = r in the bore and match u and ur du/dr*/
+  const double A1 = 0.5 * (1 + 1 / mu), C1 = 0.5 * r_in * r_in * (1 - 1 / mu);
+  const double u_out = A1 * r_out + C1 / r_out, flux = mu * (A1 - C1 / (r_out * r_out));
+  const double A2 = 0.5 * (u_out / r_out + flux), C2 = 0.5 * r_out * (u_out - flux * r_out);
+  return r_max / (A2 * r_max + C2 / r_max);
+}
+
+inline double ShellSolver::GetBx(double x, double y, double z) const
+{
+  const Level& l = fLevels[0];
+  const double r = std::sqrt(x * x + y * y);
+  double t = (z + fZMax) / l.hz;
+  const int j = std::min(std::max((int)t, 0), l.nz - 1);
+  t -= j;
+  /*u along the column at radius index i, linear in z*/
+  struct Col { const Level& l; int j; double t; double operator()(int i) const { return (1 - t) * l.u[l.Id(i, j)] + t * l.u[l.Id(i, j + 1)]; } } u = { l, j, t };
+
+  if (r < l.hr)
+    {
+      /*On axis u = a r + c r^3, and Bx = -a*/
+      const double a = (8 * u(1) - u(2)) / (6 * l.hr);
+      return -a * l.mur[(size_t)j * l.nr];
+    }
+  double s = r / l.hr;
+  const int i = std::min((int)s, l.nr - 1);
+  s -= i;
+  const size_t cell = (size_t)j * l.nr + i;
+  const double du_dr = (u(i + 1) - u(i)) / l.hr;
+  const double u_r = ((1 - s) * u(i) + s * u(i + 1)) / r;
+  const double c = x / r, sn = y / r;
+  /*B_r = -mu du/dr cos(phi), B_phi = mu u/r sin(phi)*/
+  const double B_r = -l.mur[cell] * du_dr * c, B_phi = l.mup[cell] * u_r * sn;
+  return B_r * c - B_phi * sn;
+}
+
+/*
+ * The ShellFitter class fits the material law to
+ * measured maps. Each map is one applied field B0
+ * with a list of probe points (x, y, z in the tube
+ * frame, field along x) and measured B +/- sig.
+ * A common scale on all B0 can be fitted as well,
+ * for maps where the applied field is only known
+ * from the calibration.
+ * The chi2 is minimised with Levenberg-Marquardt;
+ * the derivatives come from finite differences,
+ * one forward solve per free parameter and map,
+ * run in parallel and warm started from the
+ * current solution. The threads left over go to
+ * the smoother of each solve.
+ */
+class ShellFitter
+{
+ public:
+  struct Point { double x, y, z, B, sig; };
+  struct Map { double B0; std::vector<Point> points; };
+
+  ShellFitter(const ShellGeometry& geom, double r_max, double z_max, int nr = 128, int nz = 256)
+    : fGeom(geom), fRMax(r_max), fZMax(z_max), fNr(nr), fNz(nz), fScale(1)
+  {
+    fFree[0] = fFree[1] = true;
+    fFree[2] = fFree[3] = false;
+    for (int k = 0; k < 4; k++) fErr[k] = 0;
+  }
+
+  void AddMap(const Map& map)
+  {
+    fMaps.push_back(map);
+    fSolvers.push_back(ShellSolver(fGeom, fRMax, fZMax, fNr, fNz));
+  }
+  /*Parameters are 0: mu_sat, 1: a, 2: h0, 3: B0 scale; h0 and the scale are fixed by default*/
+  void SetFree(int par, bool free) { fFree[par] = free; }
+
+  /*Fit starting from law; returns the final chi2*/
+  double Fit(MaterialLaw& law, int max_iter = 30, int nthreads = 0);
+
+  double GetChi2(const MaterialLaw& law) { return GetChi2(law, fScale); }
+  void SetScale(double scale) { fScale = scale; }
+  double GetScale() const { return fScale; }
+  int GetNPoints() const
+  {
+    int n = 0;
+    for (size_t m = 0; m < fMaps.size(); m++) n += (int)fMaps[m].points.size();
+    return n;
+  }
+  /*Parameter errors from the last fit (0 for fixed parameters)*/
+  double GetError(int par) const { return fErr[par]; }
+  ShellSolver& GetSolver(int map) { return fSolvers[map]; }
+
+ private:
+  static double& Par(MaterialLaw& law, double& scale, int k)
+  {
+    return k == 0 ? law.mu_sat : (k == 1 ? law.a : (k == 2 ? law.h0 : scale));
+  }
+  double GetChi2(const MaterialLaw& law, double scale);
+  void Residuals(ShellSolver& solver, const Map& map, const MaterialLaw& law, double scale, double* res) const
+  {
+    solver.SetMaterial(law);
+    solver.Solve(scale * map.B0);
+    for (size_t p = 0; p < map.points.size(); p++)
+      {
+	const Point& pt = map.points[p];
+	res[p] = (solver.GetBx(pt.x, pt.y, pt.z) - pt.B) / pt.sig;
+      }
+  }
+
+  ShellGeometry fGeom;
+  double fRMax, fZMax;
+  int fNr, fNz;
+  double fScale;
+  bool fFree[4];
+  double fErr[4];
+  std::vector<Map> fMaps;
+  std::vector<ShellSolver> fSolvers;
+};
+
+inline double ShellFitter::GetChi2(const MaterialLaw& law, double scale)
+{
+  double chi2 = 0;
+  for (size_t m = 0; m < fMaps.size(); m++)
+    {
+      std::vector<double> res(fMaps[m].points.size());
+      if (res.empty()) continue;
+      Residuals(fSolvers[m], fMaps[m], law, scale, &res[0]);
+      for (size_t p = 0; p < res.size(); p++) chi2 += res[p] * res[p];
+    }
+  return chi2;
+}
+
+inline double ShellFitter::Fit(MaterialLaw& law, int max_iter, int nthreads)
+{
+  std::vector<int> free;
+  for (int k = 0; k < 4; k++) { fErr[k] = 0; if (fFree[k]) free.push_back(k); }
+  const int npar = (int)free.size(), npts = GetNPoints();
+  if (nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t m = 0; m < fSolvers.size(); m++) fSolvers[m].SetThreads(nthreads);
+
+  std::vector<double> res(npts), jac((size_t)npts * npar);
+  double chi2 = GetChi2(law);
+  double lambda = 1e-3;
+  for (int iter = 0; iter < max_iter && npar > 0; iter++)
+    {
+      /*Residuals at the current point*/
+      int offset = 0;
+      for (size_t m = 0; m < fMaps.size(); m++)
+	{
+	  if (!fMaps[m].points.empty()) Residuals(fSolvers[m], fMaps[m], law, fScale, &res[offset]);
+	  offset += (int)fMaps[m].points.size();
+	}
+
+      /*One warm started solve per (parameter, map), spread over the threads*/
+      std::vector<int> first(fMaps.size() + 1, 0);
+      for (size_t m = 0; m < fMaps.size(); m++) first[m + 1] = first[m] + (int)fMaps[m].points.size();
+      const int njobs = npar * (int)fMaps.size();
+      std::vector<std::thread> workers;
+      for (int t = 0; t < std::min(nthreads, njobs); t++)
+	workers.push_back(std::thread([&, t]()
+	  {
+	    for (int job = t; job < njobs; job += std::min(nthreads, njobs))
+	      {
+		const int k = job / (int)fMaps.size(), m = job % (int)fMaps.size();
+		if (fMaps[m].points.empty()) continue;
+		MaterialLaw shifted = law;
+		double scale = fScale;
+		const double step = 1e-4 * std::max(std::fabs(Par(shifted, scale, free[k])), 1e-2);
+		Par(shifted, scale, free[k]) += step;
+		ShellSolver solver = fSolvers[m];
+		solver.SetThreads(std::max(1, nthreads / njobs));
+		std::vector<double> r(fMaps[m].points.size());
+		Residuals(solver, fMaps[m], shifted, scale, &r[0]);
+		for (size_t p = 0; p < r.size(); p++)
+		  jac[(size_t)(first[m] + p) * npar + k] = (r[p] - res[first[m] + p]) / step;
+	      }
+	  }));
+      for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+
+      /*Normal equations J^T J d = -J^T r*/
+      std::vector<double> JtJ(npar * npar, 0), Jtr(npar, 0);
+      for (int p = 0; p < npts; p++)
+	for (int a = 0; a < npar; a++)
+	  {
+	    Jtr[a] += jac[(size_t)p * npar + a] * res[p];
+	    for (int b = 0; b < npar; b++) JtJ[a * npar + b] += jac[(size_t)p * npar + a] * jac[(size_t)p * npar + b];
+	  }
+
+      bool improved = false;
+      for (int attempt = 0; attempt < 10 && !improved; attempt++)
+	{
+	  /*Solve (JtJ + lambda diag) d = -Jtr by Gaussian elimination*/
+	  std::vector<double> A(JtJ), d(npar);
+	  for (int a = 0; a < npar; a++) { A[a * npar + a] *= 1 + lambda; d[a] = -Jtr[a]; }
+	  for (int c = 0; c < npar; c++)
+	    for (int r = c + 1; r < npar; r++)
+	      {
+		const double f = A[r * npar + c] / A[c * npar + c];
+		for (int b = c; b < npar; b++) A[r * npar + b] -= f * A[c * npar + b];
+		d[r] -= f * d[c];
+	      }
+	  for (int c = npar - 1; c >= 0; c--)
+	    {
+	      for (int b = c + 1; b < npar; b++) d[c] -= A[c * npar + b] * d[b];
+	      d[c] /= A[c * npar + c];
+	    }
+	  MaterialLaw trial = law;
+	  double trial_scale = fScale;
+	  for (int a = 0; a < npar; a++) Par(trial, trial_scale, free[a]) += d[a];
+	  const double trial_chi2 = GetChi2(trial, trial_scale);
+	  if (trial_chi2 < chi2)
+	    {
+	      const bool done = chi2 - trial_chi2 < 1e-6 * chi2 + 1e-12;
+	      law = trial;
+	      fScale = trial_scale;
+	      chi2 = trial_chi2;
+	      lambda = std::max(lambda * 0.1, 1e-9);
+	      improved = true;
+	      if (done) iter = max_iter;
+	    }
+	  else
+	    {
+	      lambda *= 10;
+	    }
+	}
+      if (!improved) break;
+
+      /*Errors from the inverse of J^T J*/
+      std::vector<double> inv(npar * npar, 0), A(JtJ);
+      for (int a = 0; a < npar; a++) inv[a * npar + a] = 1;
+      for (int c = 0; c < npar; c++)
+	{
+	  const double piv = A[c * npar + c];
+	  for (int b = 0; b < npar; b++) { A[c * npar + b] /= piv; inv[c * npar + b] /= piv; }
+	  for (int r = 0; r < npar; r++)
+	    if (r != c)
+	      {
+		const double f = A[r * npar + c];
+		for (int b = 0; b < npar; b++) { A[r * npar + b] -= f * A[c * npar + b]; inv[r * npar + b] -= f * inv[c * npar + b]; }
+	      }
+	}
+      for (int a = 0; a < npar; a++) fErr[free[a]] = std::sqrt(std::max(inv[a * npar + a], 0.0));
+    }
+  GetChi2(law);
+  return chi2;
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * Synthetic Measurement Files
+ *
+ * To write calibration, ferromagnet scan,
+ * B vs z and diameter files in the DAQ
+ * formats at any size, with a known ur, for
+ * benchmarks and for testing the analysis.
+ * To use in a macro: #include "SyntheticData.h"
+ */
+#ifndef SYNTHETICDATA_H
+#define SYNTHETICDATA_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Systematics.h"
+
+/*
+ * Shape of a ferromagnet scan. The supply steps
+ * through n_steps current setpoints up to I_max
+ * (and back down if down is set), holding each for
+ * rows_per_step rows. The supply cannot go above
+ * I_sat, so the top setpoints all read back as
+ * I_sat and the same B_in, like the repeated
+ * 6189 mA / 39.97 mT rows in fmscan2.
+ */
+struct ScanShape
+{
+  double I_max;          // mA
+  double I_sat;          // mA
+  int    n_steps;
+  int    rows_per_step;
+  bool   down;
+};
+
+/*
+ * The SyntheticScans class writes the files. All
+ * fields follow one calibration B_ext = c0 + c1 I
+ * and one material ur = p0/B_ext + p1 in a tube of
+ * radius ratio R, with Gaussian probe noise, and
+ * are printed with the precision of the DAQ. The
+ * output depends only on the seed.
+ */
+class SyntheticScans
+{
+ public:
+  SyntheticScans(uint64_t seed = 1)
+    : fRnd(seed, 0), fC0(0.05), fC1(0.009), fP0(2.0), fP1(5.0), fR(0.72),
+      fB_noise(0.0005), fI_noise(0.05), fDt(5.0)
+  {
+    fShape.I_max = 6500;  fShape.I_sat = 6189.3;
+    fShape.n_steps = 40;  fShape.rows_per_step = 5;  fShape.down = true;
+  }
+
+  /*Helmholtz calibration B_ext = c0 + c1 I (mT, mA)*/
+  void SetCalibration(double c0, double c1) { fC0 = c0; fC1 = c1; }
+  /*ur = p0/B_ext + p1 and r_in/r_out*/
+  void SetMaterial(double p0, double p1, double R) { fP0 = p0; fP1 = p1; fR = R; }
+  void SetNoise(double B_noise, double I_noise) { fB_noise = B_noise; fI_noise = I_noise; }
+  void SetShape(const ScanShape& shape) { fShape = shape; }
+
+  double GetBext(double I) const { return fC0 + fC1 * I; }
+  double GetBin(double I) const { return GetBext(I) * Transfer(Ur(GetBext(I))); }
+  double Ur(double B_ext) const { return fP0 / B_ext + fP1; }
+
+  /*Rows of about bytes_per_row characters that fill bytes*/
+  static size_t RowsForBytes(double bytes, int bytes_per_row) { return (size_t)std::max(1.0, bytes / bytes_per_row); }
+
+  /*
+   * Each writer returns the number of bytes written,
+   * 0 if the file cannot be opened.
+   */
+  /*t, I, B: sawtooth ramps from 0 to I_max*/
+  size_t WriteCalibration(const char* f_out, size_t nrows);
+  /*t, I, B: the stepped scan of ScanShape, repeated until nrows*/
+  size_t WriteScan(const char* f_out, size_t nrows);
+  /*z, B, B_err, I, I_err: axis profile of a tube of length L (mm) centred at z0*/
+  size_t WriteBvz(const char* f_out, size_t nrows, double I, double length, double z0, double r_out);
+  /*One diameter per line*/
+  size_t WriteDiameters(const char* f_out, size_t nrows, double mean, double sig);
+
+ private:
+  /*B_in/B_ext for an infinite tube, the inverse of Permeability::Value*/
+  double Transfer(double u) const { return 4 * u / ((u + 1) * (u + 1) - (u - 1) * (u - 1) * fR * fR); }
+
+  /*
+   * Buffered writer of rows of numbers with three
+   * decimals, tab separated like the DAQ files.
+   * snprintf on every value is the slow part at GB
+   * scale, so the digits are formatted by hand.
+   */
+  class Writer
+  {
+   public:
+    Writer(const char* f_out) : fOut(fopen(f_out, "w")), fBytes(0) { fBuf.reserve(1 << 20); }
+    ~Writer() { Close(); }
+    bool IsOpen() const { return fOut != 0; }
+    void Row(int n, const double* v)
+    {
+      for (int k = 0; k < n; k++)
+	{
+	  Fixed3(v[k]);
+	  fBuf.push_back(k + 1 < n ? '\t' : '\n');
+	}
+      if (fBuf.size() >= (1 << 20)) Flush();
+    }
+    size_t Close()
+    {
+      if (!fOut) return fBytes;
+      Flush();
+      fclose(fOut);
+      fOut = 0;
+      return fBytes;
+    }
+
+   private:
+    /*Same text as "%.3f" for |x| < 1e15*/
+    void Fixed3(double x)
+    {
+      if (x < 0)
+	{
+	  long long m = (long long)std::floor(-x * 1000 + 0.5);
+	  if (m > 0) fBuf.push_back('-');
+	  Digits(m);
+	}
+      else
+	{
+	  Digits((long long)std::floor(x * 1000 + 0.5));
+	}
+    }
+    void Digits(long long m)
+    {
+      char tmp[24];
+      int len = 0;
+      long long ip = m / 1000;
+      const int frac = (int)(m % 1000);
+      do { tmp[len++] = '0' + (char)(ip % 10); ip /= 10; } while (ip > 0);
+      while (len > 0) fBuf.push_back(tmp[--len]);
+      fBuf.push_back('.');
+      fBuf.push_back('0' + frac / 100);
+      fBuf.push_back('0' + frac / 10 % 10);
+      fBuf.push_back('0' + frac % 10);
+    }
+    void Flush()
+    {
+      fwrite(fBuf.data(), 1, fBuf.size(), fOut);
+      fBytes += fBuf.size();
+      fBuf.clear();
+    }
+    FILE* fOut;
+    std::string fBuf;
+    size_t fBytes;
+  };
+
+  ToyRandom fRnd;
+  double fC0, fC1, fP0, fP1, fR;
+  double fB_noise, fI_noise, fDt;
+  ScanShape fShape;
+};
+
+inline size_t SyntheticScans::WriteCalibration(const char* f_out, size_t nrows)
+{
+  Writer out(f_out);
+  if (!out.IsOpen())
+    {
+      std::cerr << "SyntheticScans: cannot write " << f_out << std::endl;
+      return 0;
+    }
+  const int per_ramp = 50;
+  for (size_t k = 0; k < nrows; k++)
+    {
+      const double I = fShape.I_max * (k % per_ramp) / (per_ramp - 1) + fI_noise * fRnd.Gaus();
+      const double row[3] = { 0.179 + fDt * k, I, GetBext(I) + fB_noise * fRnd.Gaus() };
+      out.Row(3, row);
+    }
+  return out.Close();
+}
+
+inline size_t SyntheticScans::WriteScan(const char* f_out, size_t nrows)
+{
+  Writer out(f_out);
+  if (!out.IsOpen())
+    {
+      std::cerr << "SyntheticScans: cannot write " << f_out << std::endl;
+      return 0;
+    }
+  /*Setpoints up, then down without repeating the top one*/
+  std::vector<double> setpoints;
+  for (int s = 1; s <= fShape.n_steps; s++) setpoints.push_back(fShape.I_max * s / fShape.n_steps);
+  if (fShape.down)
+    for (int s = fShape.n_steps - 1; s >= 1; s--) setpoints.push_back(fShape.I_max * s / fShape.n_steps);
+
+  size_t k = 0;
+  while (k < nrows)
+    for (size_t s = 0; s < setpoints.size() && k < nrows; s++)
+      {
+	const double I_set = std::min(setpoints[s], fShape.I_sat);
+	/*In saturation the read back and the field do not move*/
+	const bool sat = setpoints[s] >= fShape.I_sat;
+	const double B_sat = GetBin(fShape.I_sat);
+	for (int r = 0; r < fShape.rows_per_step && k < nrows; r++, k++)
+	  {
+	    const double I = I_set + fI_noise * fRnd.Gaus();
+	    const double B = sat ? B_sat : GetBin(I) + fB_noise * fRnd.Gaus();
+	    const double row[3] = { 0.293 + fDt * k, I, B };
+	    out.Row(3, row);
+	  }
+      }
+  return out.Close();
+}
+
+inline size_t SyntheticScans::WriteBvz(const char* f_out, size_t nrows, double I, double length, double z0, double r_out)
+{
+  Writer out(f_out);
+  if (!out.IsOpen())
+    {
+      std::cerr << "SyntheticScans: cannot write " << f_out << std::endl;
+      return 0;
+    }
+  /*Shielded in the middle, recovering over about one radius past each end*/
+  const double B0 = GetBext(I), t = Transfer(Ur(B0));
+  const double span = length + 8 * r_out;
+  for (size_t k = 0; k < nrows; k++)
+    {
+      const double z = z0 + span / 2 - span * (k % 1000) / 999.0;
+      const double inside = 0.5 * (std::tanh((z - z0 + length / 2) / r_out) - std::tanh((z - z0 - length / 2) / r_out));
+      const double B = B0 * (1 - (1 - t) * inside) + fB_noise * fRnd.Gaus();
+      const double row[5] = { z, B, std::fabs(fB_noise * fRnd.Gaus()), I + fI_noise * fRnd.Gaus(), std::fabs(fI_noise * fRnd.Gaus()) };
+      out.Row(5, row);
+    }
+  return out.Close();
+}
+
+inline size_t SyntheticScans::WriteDiameters(const char* f_out, size_t nrows, double mean, double sig)
+{
+  Writer out(f_out);
+  if (!out.IsOpen())
+    {
+      std::cerr << "SyntheticScans: cannot write " << f_out << std::endl;
+      return 0;
+    }
+  for (size_t k = 0; k < nrows; k++)
+    {
+      const double d = mean + sig * fRnd.Gaus();
+      out.Row(1, &d);
+    }
+  return out.Close();
+}
+
+#endif
@@ -0,0 +1,381 @@
+/*
+ * Toy Monte Carlo Systematic Bands
+ *
+ * To propagate the correlated systematic
+ * uncertainties (Helmholtz calibration,
+ * geometry and probe offset) of a
+ * ferromagnet scan into bands on ur(B_ext)
+ * by resampling them in parallel toys.
+ * To use in a macro: #include "Systematics.h"
+ */
+#ifndef SYSTEMATICS_H
+#define SYSTEMATICS_H
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include "LinearFit.h"
+#include "Permeability.h"
+
+/*
+ * Small, fast generator for the toys: xoshiro256**
+ * seeded through splitmix64. Every block of toys
+ * gets its own stream derived from (seed, block),
+ * so results do not depend on how many threads
+ * ran or which thread picked up which block.
+ */
+class ToyRandom
+{
+ public:
+  ToyRandom(uint64_t seed, uint64_t stream) : fHaveSpare(false), fSpare(0)
+  {
+    uint64_t x = seed ^ (stream * 0x9E3779B97F4A7C15ULL);
+    for (int i = 0; i < 4; i++) fS[i] = SplitMix(x);
+  }
+
+  uint64_t Next()
+  {
+    const uint64_t result = Rotl(fS[1] * 5, 7) * 9;
+    const uint64_t t = fS[1] << 17;
+    fS[2] ^= fS[0];  fS[3] ^= fS[1];
+    fS[1] ^= fS[2];  fS[0] ^= fS[3];
+    fS[2] ^= t;
+    fS[3] = Rotl(fS[3], 45);
+    return result;
+  }
+
+  /*Uniform in (0,1)*/
+  double Uniform() { return ((Next() >> 11) + 0.5) * (1.0 / 9007199254740992.0); }
+
+  /*Standard normal, Marsaglia polar method*/
+  double Gaus()
+  {
+    if (fHaveSpare) { fHaveSpare = false; return fSpare; }
+    double u, v, s;
+    do
+      {
+	u = 2.0 * Uniform() - 1.0;
+	v = 2.0 * Uniform() - 1.0;
+	s = u * u + v * v;
+      }
+    while (s >= 1.0 || s == 0.0);
+    const double f = std::sqrt(-2.0 * std::log(s) / s);
+    fSpare = v * f;
+    fHaveSpare = true;
+    return u * f;
+  }
+
+ private:
+  static uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+  static uint64_t SplitMix(uint64_t& x)
+  {
+    uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t fS[4];
+  bool     fHaveSpare;
+  double   fSpare;
+};
+
+/*
+ * The ToySystematics class holds one ferromagnet
+ * scan (Helmholtz current and measured internal
+ * field per point) and its systematic inputs:
+ *   - calibration intercept and slope with their
+ *     covariance, drawn as a correlated pair
+ *   - inner and outer radius, drawn independently
+ *   - probe offset subtracted from |B_in|
+ * Each toy draws one set of these, shared by every
+ * point of the scan, and inverts the whole scan.
+ *
+ * Toys are never stored. Each point keeps a fixed
+ * binned distribution of its ur values (range set
+ * by a short pilot run) from which the quantiles
+ * are read, plus running sums for mean and RMS.
+ * Toys with no physical solution are counted and
+ * left out.
+ */
+class ToySystematics
+{
+ public:
+  ToySystematics(const LinearFit& calib, int n, const double* I, const double* B)
+    : fI(I, I + n), fB(n), fRIn(1), fSigRIn(0), fROut(1), fSigROut(0),
+      fOffset(0), fSigOffset(0), fNToys(0)
+  {
+    for (int i = 0; i < n; i++) fB[i] = std::fabs(B[i]);
+    fP0 = calib.GetIntercept();
+    fP1 = calib.GetSlope();
+    double v00, v01, v11;
+    calib.GetCovariance(v00, v01, v11);
+    /*Cholesky factor of the 2x2 calibration covariance*/
+    fL00 = std::sqrt(v00);
+    fL10 = fL00 > 0 ? v01 / fL00 : 0.0;
+    fL11 = std::sqrt(std::max(v11 - fL10 * fL10, 0.0));
+  }
+
+  void SetGeometry(double r_in, double sig_r_in, double r_out, double sig_r_out)
+  {
+    fRIn = r_in;  fSigRIn = sig_r_in;
+    fROut = r_out;  fSigROut = sig_r_out;
+  }
+  void SetOffset(double offset, double sig_offset) { fOffset = offset; fSigOffset = sig_offset; }
+
+  /*Run ntoys toys on nthreads threads (0 = all cores)*/
+  void Run(long ntoys, int nthreads = 0, uint64_t seed = 20140716);
+
+  int GetN() const { return (int)fI.size(); }
+  long GetNToys() const { return fNToys; }
+  long GetNBad(int i) const { return fNBad.empty() ? 0 : fNBad[i]; }
+  double GetBext(int i) const { return fP0 + fP1 * fI[i]; }
+  double GetNominal(int i) const { return Permeability::Value(GetBext(i), fB[i] - fOffset, fROut > 0 ? fRIn / fROut : 0); }
+  double GetMean(int i) const;
+  double GetRMS(int i) const;
+  double GetQuantile(int i, double p) const;
+
+  /*
+   * Write "Bext mu mu_err" where mu +/- mu_err spans
+   * the central interval of probability cl, so the
+   * file can be drawn as an "LE3" band by
+   * makePlots_mur_v1.C. If the scan turns around,
+   * the up and down ramps are also written to
+   * <prefix>_p1.txt and <prefix>_p2.txt, sharing the
+   * turning point, so each band is drawn separately.
+   */
+  void WriteBands(const char* prefix, double cl = 0.682689492) const;
+
+  static const int  kNBins = 4000;
+  static const long kBlock = 4096;
+  static const long kPilot = 4096;
+  static const long kSlots = 64;
+
+ private:
+  struct Toy { double p0, p1, R, offset; };
+  Toy Draw(ToyRandom& rnd) const
+  {
+    Toy t;
+    const double z0 = rnd.Gaus(), z1 = rnd.Gaus();
+    t.p0 = fP0 + fL00 * z0;
+    t.p1 = fP1 + fL10 * z0 + fL11 * z1;
+    t.R = (fRIn + fSigRIn * rnd.Gaus()) / (fROut + fSigROut * rnd.Gaus());
+    t.offset = fOffset + fSigOffset * rnd.Gaus();
+    return t;
+  }
+  void Invert(const Toy& t, double* B_ext, double* B_in, double* ur) const
+  {
+    const int n = GetN();
+    for (int i = 0; i < n; i++)
+      {
+	B_ext[i] = t.p0 + t.p1 * fI[i];
+	B_in[i] = fB[i] - t.offset;
+      }
+    Permeability::Values(n, B_ext, B_in, t.R, ur);
+  }
+  /*
+   * Blocks are handed out in order and their sums
+   * merged in order into fSum, fSum2 and fNBad as
+   * soon as every earlier block is in, so the
+   * result does not depend on the threads. At most
+   * kSlots blocks wait to be merged at a time.
+   */
+  struct BlockMerge
+  {
+    std::mutex m;
+    std::condition_variable cv;
+    long next, merged;
+    std::vector<double> sums;   // kSlots x n x (sum, sum2, bad)
+    std::vector<char> done;     // kSlots
+  };
+  void RunBlocks(BlockMerge* merge, long nblocks, long ntoys, uint64_t seed, std::vector<unsigned>* hist);
+  void WriteBandFile(const std::string& f_out, int first, int last, double cl) const;
+
+  std::vector<double> fI, fB;
+  double fP0, fP1, fL00, fL10, fL11;
+  double fRIn, fSigRIn, fROut, fSigROut;
+  double fOffset, fSigOffset;
+
+  long fNToys;
+  std::vector<double> fLo, fWidth;      // per point histogram range
+  std::vector<unsigned> fHist;          // per point: under, kNBins, over
+  std::vector<long> fNBad;
+  std::vector<double> fSum, fSum2;      // of ur - nominal
+};
+
+inline void ToySystematics::Run(long ntoys, int nthreads, uint64_t seed)
+{
+  const int n = GetN();
+  fNToys = ntoys;
+  if (nthreads <= 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+
+  /*Pilot run on its own stream to fix the histogram ranges*/
+  std::vector<double> lo(n, HUGE_VAL), hi(n, -HUGE_VAL), B_ext(n), B_in(n), ur(n);
+  ToyRandom pilot(seed, ~0ULL);
+  for (long k = 0; k < kPilot; k++)
+    {
+      Invert(Draw(pilot), &B_ext[0], &B_in[0], &ur[0]);
+      for (int i = 0; i < n; i++)
+	if (ur[i] == ur[i]) { lo[i] = std::min(lo[i], ur[i]); hi[i] = std::max(hi[i], ur[i]); }
+    }
+  fLo.assign(n, 0);
+  fWidth.assign(n, 0);
+  for (int i = 0; i < n; i++)
+    {
+      if (!(hi[i] >= lo[i])) { lo[i] = hi[i] = GetNominal(i); }
+      const double margin = 0.5 * (hi[i] - lo[i]) + 1e-9 * (std::fabs(hi[i]) + 1.0);
+      fLo[i] = lo[i] - margin;
+      fWidth[i] = (hi[i] - lo[i] + 2 * margin) / kNBins;
+    }
+
+  /*Toys in fixed blocks, each with its own random stream; memory does not grow with ntoys*/
+  const long nblocks = (ntoys + kBlock - 1) / kBlock;
+  fNBad.assign(n, 0);
+  fSum.assign(n, 0);
+  fSum2.assign(n, 0);
+  BlockMerge merge;
+  merge.next = merge.merged = 0;
+  merge.sums.assign((size_t)kSlots * n * 3, 0.0);
+  merge.done.assign(kSlots, 0);
+  std::vector< std::vector<unsigned> > hist(nthreads);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < nthreads; t++)
+    workers.push_back(std::thread(&ToySystematics::RunBlocks, this, &merge, nblocks, ntoys, seed, &hist[t]));
+  for (int t = 0; t < nthreads; t++) workers[t].join();
+
+  /*Counts add exactly in any order*/
+  fHist.assign((size_t)n * (kNBins + 2), 0);
+  for (int t = 0; t < nthreads; t++)
+    for (size_t k = 0; k < hist[t].size(); k++) fHist[k] += hist[t][k];
+}
+
+inline void ToySystematics::RunBlocks(BlockMerge* merge, long nblocks, long ntoys, uint64_t seed,
+				      std::vector<unsigned>* hist)
+{
+  const int n = GetN();
+  hist->assign((size_t)n * (kNBins + 2), 0);
+  std::vector<double> B_ext(n), B_in(n), ur(n), nominal(n), inv_width(n), block(3 * n);
+  for (int i = 0; i < n; i++) { nominal[i] = GetNominal(i); inv_width[i] = 1.0 / fWidth[i]; }
+
+  while (true)
+    {
+      long b;
+      {
+	/*Take the next block once its slot is free*/
+	std::unique_lock<std::mutex> lock(merge->m);
+	while (merge->next < nblocks && merge->next >= merge->merged + kSlots) merge->cv.wait(lock);
+	if (merge->next >= nblocks) break;
+	b = merge->next++;
+      }
+      ToyRandom rnd(seed, (uint64_t)b);
+      double* sums = &block[0];
+      std::fill(block.begin(), block.end(), 0.0);
+      const long ntoy = std::min(kBlock, ntoys - b * kBlock);
+      for (long k = 0; k < ntoy; k++)
+	{
+	  Invert(Draw(rnd), &B_ext[0], &B_in[0], &ur[0]);
+	  for (int i = 0; i < n; i++)
+	    {
+	      unsigned* h = &(*hist)[(size_t)i * (kNBins + 2)];
+	      if (ur[i] != ur[i]) { sums[3 * i + 2] += 1; continue; }
+	      const double d = ur[i] - nominal[i];
+	      sums[3 * i] += d;
+	      sums[3 * i + 1] += d * d;
+	      const double x = (ur[i] - fLo[i]) * inv_width[i];
+	      const int bin = x < 0 ? 0 : (x >= kNBins ? kNBins + 1 : (int)x + 1);
+	      h[bin]++;
+	    }
+	}
+
+      /*Park the block, then merge every block that is now next in order*/
+      std::lock_guard<std::mutex> lock(merge->m);
+      std::copy(block.begin(), block.end(), merge->sums.begin() + (size_t)(b % kSlots) * n * 3);
+      merge->done[b % kSlots] = 1;
+      while (merge->merged < nblocks && merge->done[merge->merged % kSlots])
+	{
+	  const size_t slot = (size_t)(merge->merged % kSlots);
+	  const double* s = &merge->sums[slot * n * 3];
+	  for (int i = 0; i < n; i++)
+	    {
+	      fSum[i] += s[3 * i];  fSum2[i] += s[3 * i + 1];  fNBad[i] += (long)s[3 * i + 2];
+	    }
+	  merge->done[slot] = 0;
+	  merge->merged++;
+	}
+      merge->cv.notify_all();
+    }
+}
+
+inline double ToySystematics::GetMean(int i) const
+{
+  const long ngood = fNToys - fNBad[i];
+  return ngood > 0 ? GetNominal(i) + fSum[i] / ngood : GetNominal(i);
+}
+
+inline double ToySystematics::GetRMS(int i) const
+{
+  const long ngood = fNToys - fNBad[i];
+  if (ngood < 2) return 0;
+  const double m = fSum[i] / ngood;
+  return std::sqrt(std::max(fSum2[i] / ngood - m * m, 0.0));
+}
+
+inline double ToySystematics::GetQuantile(int i, double p) const
+{
+  const unsigned* h = &fHist[(size_t)i * (kNBins + 2)];
+  const double ngood = (double)(fNToys - fNBad[i]);
+  if (ngood <= 0) return GetNominal(i);
+  const double target = p * ngood;
+  double cum = h[0];
+  if (target <= cum)
+    {
+      if (h[0] > 0) std::cerr << "ToySystematics: quantile " << p << " of point " << i << " below histogram range" << std::endl;
+      return fLo[i];
+    }
+  for (int k = 1; k <= kNBins; k++)
+    {
+      if (cum + h[k] >= target)
+	return fLo[i] + fWidth[i] * ((k - 1) + (target - cum) / h[k]);
+      cum += h[k];
+    }
+  std::cerr << "ToySystematics: quantile " << p << " of point " << i << " above histogram range" << std::endl;
+  return fLo[i] + fWidth[i] * kNBins;
+}
+
+inline void ToySystematics::WriteBandFile(const std::string& f_out, int first, int last, double cl) const
+{
+  std::ofstream out(f_out.c_str());
+  out.precision(12);
+  for (int i = first; i <= last; i++)
+    {
+      const double lo = GetQuantile(i, 0.5 * (1 - cl));
+      const double hi = GetQuantile(i, 0.5 * (1 + cl));
+      out << GetBext(i) << " \t " << 0.5 * (hi + lo) << " \t " << 0.5 * (hi - lo) << " \n";
+    }
+}
+
+inline void ToySystematics::WriteBands(const char* prefix, double cl) const
+{
+  const int n = GetN();
+  if (n == 0) return;
+  WriteBandFile(std::string(prefix) + ".txt", 0, n - 1, cl);
+  int turn = 0;
+  for (int i = 1; i < n; i++)
+    if (GetBext(i) > GetBext(turn)) turn = i;
+  if (turn > 0 && turn < n - 1)
+    {
+      WriteBandFile(std::string(prefix) + "_p1.txt", 0, turn, cl);
+      WriteBandFile(std::string(prefix) + "_p2.txt", turn, n - 1, cl);
+    }
+}
+
+#endif